@@ -0,0 +1,263 @@
+/*
+Sqlite Database wrapper for Modern C++
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+SPDX-License-Identifier: MIT
+
+Copyright (c) 2020 Ivan Volnov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Micro-benchmarks of the wrapper hot paths against equivalent raw sqlite3 C API code.
+// Usage: sqlite_database_bench [filter] [min_time_ms]
+
+#include <sqlite_database/sqlite_database.h>
+#include <libs/sqlite3/sqlite3.h>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+
+
+
+namespace {
+
+constexpr int table_rows = 10000;
+volatile int64_t sink = 0;
+
+struct Options
+{
+    std::string filter;
+    std::chrono::milliseconds min_time{300};
+};
+
+// Runs fn in growing batches until min_time has passed and prints the time per operation
+void run(const Options &options, const char *name, const std::function<void(int64_t)> &fn)
+{
+    if (!options.filter.empty() && !strstr(name, options.filter.c_str())) {
+        return;
+    }
+    using clock = std::chrono::steady_clock;
+    fn(0); // warm up
+    int64_t iterations = 1;
+    int64_t total_iterations = 0;
+    clock::duration total_time{};
+    while (total_time < options.min_time) {
+        const auto start = clock::now();
+        for (int64_t i = 0; i < iterations; ++i) {
+            fn(total_iterations + i);
+        }
+        total_time += clock::now() - start;
+        total_iterations += iterations;
+        iterations *= 2;
+    }
+    const double ns = std::chrono::duration<double, std::nano>(total_time).count() / total_iterations;
+    std::cout << std::left << std::setw(40) << name << std::right
+              << std::setw(14) << std::fixed << std::setprecision(1) << ns << " ns/op"
+              << std::setw(14) << total_iterations << " iterations" << std::endl;
+}
+
+void check(int res, sqlite3 *db)
+{
+    if (res != SQLITE_OK && res != SQLITE_ROW && res != SQLITE_DONE) {
+        throw DatabaseException(db);
+    }
+}
+
+sqlite3_stmt *prepare(sqlite3 *db, const char *sql)
+{
+    sqlite3_stmt *stmt;
+    check(sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr), db);
+    return stmt;
+}
+
+void fill(const std::shared_ptr<SqliteDatabase> &database)
+{
+    database->exec("CREATE TABLE items (id INTEGER PRIMARY KEY, name TEXT NOT NULL, value INTEGER NOT NULL, tags TEXT NOT NULL)");
+    auto transaction = database->begin_transaction();
+    auto sql = database->create_query();
+    sql << "INSERT INTO items (id, name, value, tags) VALUES (?, ?, ?, ?)";
+    for (int i = 0; i < table_rows; ++i) {
+        sql.bind(i).bind("item_" + std::to_string(i)).bind(i * 7).bind("1,22,333,4444,55555,666666,7777777,88888888");
+        sql.step();
+        sql.clear_bindings();
+    }
+}
+
+void bench_select(const Options &options, const std::shared_ptr<SqliteDatabase> &database, sqlite3 *db)
+{
+    run(options, "point_select/wrapper", [&](int64_t i) {
+        auto sql = database->create_query();
+        sql << "SELECT name, value FROM items WHERE id = ?";
+        sql.bind(i % table_rows);
+        sql.step();
+        sink += sql.get_string().size() + sql.get_int64();
+    });
+    sqlite3_stmt *stmt = prepare(db, "SELECT name, value FROM items WHERE id = ?");
+    run(options, "point_select/raw", [&](int64_t i) {
+        sqlite3_bind_int64(stmt, 1, i % table_rows);
+        check(sqlite3_step(stmt), db);
+        sink += std::string(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)), sqlite3_column_bytes(stmt, 0)).size()
+                + sqlite3_column_int64(stmt, 1);
+        sqlite3_reset(stmt);
+    });
+    sqlite3_finalize(stmt);
+
+    run(options, "range_scan_1000/wrapper", [&](int64_t i) {
+        auto sql = database->create_query();
+        sql << "SELECT name, value FROM items WHERE id >= ? LIMIT 1000";
+        sql.bind(i % (table_rows - 1000));
+        while (sql.step()) {
+            sink += sql.get_string().size() + sql.get_int64();
+        }
+    });
+    stmt = prepare(db, "SELECT name, value FROM items WHERE id >= ? LIMIT 1000");
+    run(options, "range_scan_1000/raw", [&](int64_t i) {
+        sqlite3_bind_int64(stmt, 1, i % (table_rows - 1000));
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            sink += std::string(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)), sqlite3_column_bytes(stmt, 0)).size()
+                    + sqlite3_column_int64(stmt, 1);
+        }
+        sqlite3_reset(stmt);
+    });
+    sqlite3_finalize(stmt);
+}
+
+void bench_insert(const Options &options, const std::shared_ptr<SqliteDatabase> &database, sqlite3 *db)
+{
+    database->exec("CREATE TABLE inserts (a INTEGER, b TEXT)");
+    auto transaction = database->begin_transaction();
+
+    run(options, "insert_row/wrapper", [&](int64_t i) {
+        auto sql = database->create_query();
+        sql << "INSERT INTO inserts (a, b) VALUES (?, ?)";
+        sql.bind(i).bind("value");
+        sql.step();
+    });
+    sqlite3_stmt *stmt = prepare(db, "INSERT INTO inserts (a, b) VALUES (?, ?)");
+    run(options, "insert_row/raw", [&](int64_t i) {
+        sqlite3_bind_int64(stmt, 1, i);
+        sqlite3_bind_text(stmt, 2, "value", -1, SQLITE_TRANSIENT);
+        check(sqlite3_step(stmt), db);
+        sqlite3_reset(stmt);
+    });
+    sqlite3_finalize(stmt);
+
+    constexpr int rows = 100;
+    run(options, "insert_add_array_100/wrapper", [&](int64_t i) {
+        auto sql = database->create_query();
+        sql << "INSERT INTO inserts (a, b) VALUES";
+        sql.add_array(2, rows);
+        for (int row = 0; row < rows; ++row) {
+            sql.bind(i).bind("value");
+        }
+        sql.step();
+    });
+    std::string batch_sql = "INSERT INTO inserts (a, b) VALUES (?,?)";
+    for (int row = 1; row < rows; ++row) {
+        batch_sql += ",(?,?)";
+    }
+    stmt = prepare(db, batch_sql.c_str());
+    run(options, "insert_add_array_100/raw", [&](int64_t i) {
+        for (int row = 0; row < rows; ++row) {
+            sqlite3_bind_int64(stmt, row * 2 + 1, i);
+            sqlite3_bind_text(stmt, row * 2 + 2, "value", -1, SQLITE_TRANSIENT);
+        }
+        check(sqlite3_step(stmt), db);
+        sqlite3_reset(stmt);
+    });
+    sqlite3_finalize(stmt);
+
+    transaction.rollback();
+}
+
+void bench_transaction(const Options &options, const std::shared_ptr<SqliteDatabase> &database, sqlite3 *db)
+{
+    run(options, "transaction/wrapper", [&](int64_t) {
+        auto transaction = database->begin_transaction();
+    });
+    sqlite3_stmt *begin = prepare(db, "BEGIN");
+    sqlite3_stmt *commit = prepare(db, "COMMIT");
+    run(options, "transaction/raw", [&](int64_t) {
+        check(sqlite3_step(begin), db);
+        sqlite3_reset(begin);
+        check(sqlite3_step(commit), db);
+        sqlite3_reset(commit);
+    });
+    sqlite3_finalize(begin);
+    sqlite3_finalize(commit);
+}
+
+void bench_int64_array(const Options &options, const std::shared_ptr<SqliteDatabase> &database, sqlite3 *db)
+{
+    run(options, "get_int64_array/wrapper", [&](int64_t i) {
+        auto sql = database->create_query();
+        sql << "SELECT tags FROM items WHERE id = ?";
+        sql.bind(i % table_rows);
+        sql.step();
+        sink += sql.get_int64_array().size();
+    });
+    sqlite3_stmt *stmt = prepare(db, "SELECT tags FROM items WHERE id = ?");
+    run(options, "get_int64_array/raw", [&](int64_t i) {
+        sqlite3_bind_int64(stmt, 1, i % table_rows);
+        check(sqlite3_step(stmt), db);
+        std::vector<int64_t> result;
+        auto str = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+        while (*str) {
+            char *end;
+            result.push_back(strtoll(str, &end, 10));
+            str = *end ? end + 1 : end;
+        }
+        sink += result.size();
+        sqlite3_reset(stmt);
+    });
+    sqlite3_finalize(stmt);
+}
+
+} // namespace
+
+
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    if (argc > 1) {
+        options.filter = argv[1];
+    }
+    if (argc > 2) {
+        options.min_time = std::chrono::milliseconds(std::stoll(argv[2]));
+    }
+    try {
+        // Both sides run on the same connection
+        auto database = SqliteDatabase::open_in_memory();
+        fill(database);
+        sqlite3 *db = database->get_handle();
+
+        bench_select(options, database, db);
+        bench_insert(options, database, db);
+        bench_transaction(options, database, db);
+        bench_int64_array(options, database, db);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+/*
+Sqlite Database wrapper for Modern C++
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+SPDX-License-Identifier: MIT
+
+Copyright (c) 2020 Ivan Volnov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef ASYNC_DATABASE_H
+#define ASYNC_DATABASE_H
+
+#include <sqlite_database/database_task.h>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+
+
+
+// Runs database work on a dedicated worker thread that owns the connection.
+// Tasks are pushed to a lock-free multi-producer queue and completed through std::future.
+// Consecutive write tasks are executed in one transaction, each inside its own savepoint,
+// so a failing write is rolled back alone and the futures of the batch are completed after the shared commit.
+// The connection must not be used directly while the AsyncDatabase is alive.
+// Requires sqlite built with SQLITE_DATABASE_THREADSAFE=ON
+class AsyncDatabase
+{
+public:
+    AsyncDatabase(std::shared_ptr<SqliteDatabase> database) MAYTHROW;
+    ~AsyncDatabase();
+    AsyncDatabase(const AsyncDatabase &) = delete;
+    AsyncDatabase &operator=(const AsyncDatabase &) = delete;
+
+    static std::unique_ptr<AsyncDatabase> open(const std::string &filename, const OpenOptions &options = OpenOptions()) MAYTHROW;
+
+    // fn is called as fn(SqliteDatabase &) on the worker thread
+    template<typename F>
+    auto submit(F &&fn)
+    {
+        return push(std::forward<F>(fn), false);
+    }
+
+    template<typename F>
+    auto submit_write(F &&fn)
+    {
+        return push(std::forward<F>(fn), true);
+    }
+
+private:
+    template<typename F>
+    auto push(F &&fn, bool write)
+    {
+        using R = std::invoke_result_t<std::decay_t<F> &, SqliteDatabase &>;
+        auto task = new DatabaseFunctionTask<F, R>(std::forward<F>(fn), write);
+        auto future = task->promise.get_future();
+        push(task);
+        return future;
+    }
+
+    void push(DatabaseTask *task) noexcept;
+    void run() noexcept;
+    DatabaseTask *pop_all() noexcept;
+    void execute(DatabaseTask *tasks) noexcept;
+
+    std::shared_ptr<SqliteDatabase> database;
+    std::atomic<DatabaseTask *> head = nullptr;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool stopping = false;
+    std::thread worker;
+};
+
+
+#endif // ASYNC_DATABASE_H
@@ -0,0 +1,112 @@
+/*
+Sqlite Database wrapper for Modern C++
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+SPDX-License-Identifier: MIT
+
+Copyright (c) 2020 Ivan Volnov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef BLOB_STREAM_H
+#define BLOB_STREAM_H
+
+#include <sqlite_database/sqlite_database.h>
+#include <istream>
+#include <ostream>
+
+typedef struct sqlite3_blob sqlite3_blob;
+
+
+
+// Incremental blob I/O. The blob size is fixed: writes can't extend it, use bind_zeroblob() to reserve space.
+// Modifying the row invalidates the handle (further reads and writes throw), reopen() moves it to another row
+class BlobStream
+{
+public:
+    BlobStream(std::shared_ptr<SqliteDatabase> database, const char *table, const char *column, int64_t rowid,
+               bool writable = false, const char *schema = "main") MAYTHROW;
+    ~BlobStream();
+    BlobStream(const BlobStream &) = delete;
+    BlobStream &operator=(const BlobStream &) = delete;
+
+    size_t size() const noexcept;
+
+    // Reads up to size bytes at offset into the buffer. Returns the number of bytes read
+    size_t read(void *buffer, size_t size, size_t offset) MAYTHROW;
+    void write(const void *data, size_t size, size_t offset) MAYTHROW;
+
+    // Moves the handle to another row of the same table and column
+    void reopen(int64_t rowid) MAYTHROW;
+
+private:
+    std::shared_ptr<SqliteDatabase> database;
+    sqlite3_blob *blob = nullptr;
+    size_t blob_size = 0;
+};
+
+
+
+// std::streambuf over a BlobStream with a fixed size chunk buffer
+class BlobStreamBuffer : public std::streambuf
+{
+public:
+    BlobStreamBuffer(BlobStream &blob, size_t buffer_size = 64 * 1024);
+    ~BlobStreamBuffer() override;
+
+protected:
+    int_type underflow() override;
+    int_type overflow(int_type ch) override;
+    int sync() override;
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+private:
+    bool flush() noexcept;
+    size_t position() const noexcept;
+
+    BlobStream &blob;
+    std::vector<char> buffer;
+    size_t offset = 0; // blob position of the buffer start
+};
+
+
+
+class BlobInputStream : public std::istream
+{
+public:
+    BlobInputStream(BlobStream &blob, size_t buffer_size = 64 * 1024);
+
+private:
+    BlobStreamBuffer buffer;
+};
+
+class BlobOutputStream : public std::ostream
+{
+public:
+    BlobOutputStream(BlobStream &blob, size_t buffer_size = 64 * 1024);
+    ~BlobOutputStream() override;
+
+private:
+    BlobStreamBuffer buffer;
+};
+
+
+#endif // BLOB_STREAM_H
@@ -0,0 +1,98 @@
+/*
+Sqlite Database wrapper for Modern C++
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+SPDX-License-Identifier: MIT
+
+Copyright (c) 2020 Ivan Volnov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef CHANGE_CAPTURE_H
+#define CHANGE_CAPTURE_H
+
+#ifndef SQLITE_DATABASE_ENABLE_SESSION
+#error "ChangeCapture requires sqlite built with the session extension: configure with -DSQLITE_DATABASE_ENABLE_SESSION=ON"
+#endif
+
+#include <sqlite_database/sqlite_database.h>
+#include <istream>
+#include <ostream>
+
+typedef struct sqlite3_session sqlite3_session;
+
+
+
+// What to do with a change that doesn't match the replica
+enum class ChangeConflictPolicy
+{
+    Abort,    // roll back the whole changeset and throw
+    Replace,  // overwrite conflicting rows, skip changes of missing rows and constraint violations
+    Omit,     // skip the conflicting changes
+};
+
+// Records the changes of a connection with the sqlite session extension, one changeset per committed
+// outermost Transaction, and passes them to the sink in commit order. Changes made outside a Transaction
+// are collected until the next Transaction begins or flush() is called. Only tables with a PRIMARY KEY are recorded.
+// If the sink throws, the exception propagates from the commit and the changes are sent again with the next changeset.
+// Triggers of a replica fire while a changeset is applied, replicated tables shouldn't have triggers there
+class ChangeCapture
+{
+public:
+    // sequence numbers are consecutive and start after the one passed to the constructor
+    using Sink = std::function<void(uint64_t sequence, BlobView changeset)>;
+
+    // Records the given tables, or all tables of the schema if the list is empty.
+    // last_sequence continues the numbering of a previous capture, e.g. after a restart
+    ChangeCapture(std::shared_ptr<SqliteDatabase> database, Sink sink, const std::vector<std::string> &tables = {},
+                  uint64_t last_sequence = 0, const char *schema = "main") MAYTHROW;
+    // Changes that haven't been flushed are dropped
+    ~ChangeCapture();
+    ChangeCapture(const ChangeCapture &) = delete;
+    ChangeCapture &operator=(const ChangeCapture &) = delete;
+
+    // Passes the changes recorded since the last changeset to the sink
+    void flush() MAYTHROW;
+    uint64_t get_last_sequence() const noexcept;
+
+    // Writes every changeset to the stream as a frame: varint sequence, varint size, changeset
+    static Sink stream_to(std::ostream &stream);
+
+    // Applies the changeset in a savepoint, all changes or none
+    static void apply(SqliteDatabase &replica, BlobView changeset,
+                      ChangeConflictPolicy policy = ChangeConflictPolicy::Abort) MAYTHROW;
+    // Applies the frames written by stream_to() until the end of the stream. Frames up to after are skipped,
+    // so a replica can resume from the last sequence it has applied. Returns the last applied sequence
+    static uint64_t apply_stream(SqliteDatabase &replica, std::istream &stream, uint64_t after = 0,
+                                 ChangeConflictPolicy policy = ChangeConflictPolicy::Abort) MAYTHROW;
+
+private:
+    sqlite3_session *create_session() const MAYTHROW;
+
+    std::shared_ptr<SqliteDatabase> database;
+    Sink sink;
+    std::vector<std::string> tables;
+    std::string schema;
+    sqlite3_session *session = nullptr;
+    uint64_t sequence;
+};
+
+
+#endif // CHANGE_CAPTURE_H
@@ -0,0 +1,175 @@
+/*
+Sqlite Database wrapper for Modern C++
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+SPDX-License-Identifier: MIT
+
+Copyright (c) 2020 Ivan Volnov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef CONNECTION_POOL_H
+#define CONNECTION_POOL_H
+
+#include <sqlite_database/sqlite_database.h>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+
+struct sqlite3_snapshot;
+
+
+
+// Pool of connections to a single WAL database: one writer and N read-only readers.
+// Connections are handed out as leases and returned to the pool when the lease is destroyed.
+// Queries created from a leased connection must not outlive the lease.
+// Requires sqlite built with SQLITE_DATABASE_THREADSAFE=ON
+class ConnectionPool : public std::enable_shared_from_this<ConnectionPool>
+{
+public:
+    class Lease
+    {
+        friend class ConnectionPool;
+
+    public:
+        ~Lease();
+        Lease(Lease &&other) noexcept;
+        Lease &operator=(Lease &&other) noexcept;
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+
+        inline SqliteDatabase *operator->() const noexcept
+        {
+            return database.get();
+        }
+        inline SqliteDatabase &operator*() const noexcept
+        {
+            return *database;
+        }
+        inline const std::shared_ptr<SqliteDatabase> &get() const noexcept
+        {
+            return database;
+        }
+        inline bool is_writer() const noexcept
+        {
+            return writer;
+        }
+
+        void release() noexcept;
+
+    private:
+        Lease(std::shared_ptr<ConnectionPool> pool, std::shared_ptr<SqliteDatabase> database, bool writer) noexcept;
+
+        std::shared_ptr<ConnectionPool> pool;
+        std::shared_ptr<SqliteDatabase> database;
+        bool writer;
+    };
+
+    // The writer is always switched to WAL. Readers are opened read-only with the same options
+    ConnectionPool(const std::string &filename, size_t readers, const OpenOptions &options = OpenOptions::read_heavy()) MAYTHROW;
+    ConnectionPool(const ConnectionPool &) = delete;
+    ConnectionPool &operator=(const ConnectionPool &) = delete;
+
+    static std::shared_ptr<ConnectionPool> open(const std::string &filename, size_t readers,
+                                                const OpenOptions &options = OpenOptions::read_heavy()) MAYTHROW;
+
+    // Block until a connection is available
+    Lease acquire_reader();
+    Lease acquire_writer();
+
+    size_t get_reader_count() const noexcept;
+    const std::string &get_filename() const noexcept;
+
+    // Splits the integer key range of partition_key ("table.column", the column should be the rowid or indexed)
+    // into up to n sub-ranges and scans them in parallel on separate readers within one WAL read snapshot.
+    // The {partition} placeholder in sql_template is replaced by the sub-range condition:
+    //     pool->parallel_scan("SELECT sum(size) FROM files WHERE {partition}", "files.rowid", 8,
+    //                         [](Query &query) { query.step(); return query.get_int64(); },
+    //                         [](int64_t a, int64_t b) { return a + b; });
+    // scan(Query &) is called concurrently from different threads, reduce(R, R) merges the results in the key order.
+    // n is capped at the reader count, the readers are taken together once that many are idle
+    template<typename Scan, typename Reduce>
+    auto parallel_scan(const std::string &sql_template, const std::string &partition_key, size_t n,
+                       Scan &&scan, Reduce &&reduce) MAYTHROW
+    {
+        using R = std::invoke_result_t<Scan &, Query &>;
+        ScanSnapshot snapshot(*this, sql_template, partition_key, n);
+        auto run = [&](SqliteDatabase &database, size_t idx) {
+            auto query = database.create_query();
+            query << snapshot.sql;
+            query.bind_named(":partition_first", snapshot.ranges[idx].first);
+            query.bind_named(":partition_last", snapshot.ranges[idx].second);
+            return scan(query);
+        };
+        std::vector<std::future<R>> futures;
+        futures.reserve(snapshot.ranges.size() - 1);
+        for (size_t idx = 1; idx < snapshot.ranges.size(); ++idx) {
+            futures.push_back(std::async(std::launch::async, [&, idx] {
+                auto &lease = snapshot.leases[idx];
+                auto transaction = lease->begin_transaction();
+                snapshot.open(*lease);
+                return run(*lease, idx);
+            }));
+        }
+        R result = run(*snapshot.leases.front(), 0);
+        for (auto &future : futures) {
+            result = reduce(std::move(result), future.get());
+        }
+        return result;
+    }
+
+private:
+    // Read transaction that pins the snapshot shared by all parallel_scan readers
+    class ScanSnapshot
+    {
+    public:
+        ScanSnapshot(ConnectionPool &pool, const std::string &sql_template, const std::string &partition_key, size_t n) MAYTHROW;
+        ~ScanSnapshot();
+        ScanSnapshot(const ScanSnapshot &) = delete;
+        ScanSnapshot &operator=(const ScanSnapshot &) = delete;
+
+        // Has to be called right after BEGIN, before anything is read
+        void open(SqliteDatabase &database) MAYTHROW;
+
+        // A reader per range, taken at once. The first one holds the snapshot
+        std::vector<Lease> leases;
+        std::unique_ptr<Transaction> transaction;
+        sqlite3_snapshot *snapshot = nullptr;
+        std::string sql;
+        // Inclusive key ranges
+        std::vector<std::pair<int64_t, int64_t>> ranges;
+    };
+
+    // Blocks until n readers are idle and takes them together
+    std::vector<Lease> acquire_readers(size_t n);
+    void release(std::shared_ptr<SqliteDatabase> database, bool writer) noexcept;
+
+    const std::string filename;
+    std::shared_ptr<SqliteDatabase> writer;
+    std::vector<std::shared_ptr<SqliteDatabase>> idle_readers;
+    size_t reader_count;
+    bool writer_leased = false;
+    std::mutex mutex;
+    std::condition_variable reader_released;
+    std::condition_variable writer_released;
+};
+
+
+#endif // CONNECTION_POOL_H
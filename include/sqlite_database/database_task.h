@@ -0,0 +1,142 @@
+/*
+Sqlite Database wrapper for Modern C++
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+SPDX-License-Identifier: MIT
+
+Copyright (c) 2020 Ivan Volnov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef DATABASE_TASK_H
+#define DATABASE_TASK_H
+
+#include <sqlite_database/sqlite_database.h>
+#include <future>
+#include <optional>
+
+
+
+// Unit of work queued to a worker thread that owns a connection.
+// Tasks are linked into intrusive lists, so queuing doesn't allocate anything but the task itself
+class DatabaseTask
+{
+public:
+    DatabaseTask(bool write) noexcept :
+        write(write)
+    {
+
+    }
+    virtual ~DatabaseTask() = default;
+
+    // Returns false if the task has thrown
+    virtual bool run(SqliteDatabase &database) noexcept = 0;
+    virtual void complete(std::exception_ptr error) noexcept = 0;
+
+    // Runs the tasks from first up to end in one transaction, each inside its own savepoint, so a failing task
+    // is rolled back alone. on_commit(count) is called after the commit, then the tasks are completed and deleted.
+    // If the transaction fails, all tasks are completed with its error
+    template<typename OnCommit>
+    static void run_write_batch(SqliteDatabase &database, DatabaseTask *first, DatabaseTask *end, OnCommit &&on_commit) noexcept
+    {
+        std::exception_ptr error;
+        try {
+            size_t count = 0;
+            auto transaction = database.begin_transaction();
+            for (auto task = first; task != end; task = task->next, ++count) {
+                auto savepoint = database.begin_transaction();
+                if (task->run(database)) {
+                    savepoint.commit();
+                }
+                else {
+                    savepoint.rollback();
+                }
+            }
+            transaction.commit();
+            on_commit(count);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        while (first != end) {
+            auto task = first;
+            first = first->next;
+            task->complete(error);
+            delete task;
+        }
+    }
+
+    const bool write;
+    DatabaseTask *next = nullptr;
+};
+
+
+
+// Wraps fn(SqliteDatabase &) and completes a std::future with its result
+template<typename F, typename R>
+class DatabaseFunctionTask : public DatabaseTask
+{
+public:
+    DatabaseFunctionTask(F &&fn, bool write) :
+        DatabaseTask(write), fn(std::forward<F>(fn))
+    {
+
+    }
+
+    bool run(SqliteDatabase &database) noexcept override
+    {
+        try {
+            if constexpr (std::is_void_v<R>) {
+                fn(database);
+            }
+            else {
+                result.emplace(fn(database));
+            }
+            return true;
+        } catch (...) {
+            error = std::current_exception();
+            return false;
+        }
+    }
+
+    void complete(std::exception_ptr batch_error) noexcept override
+    {
+        try {
+            if (error || batch_error) {
+                promise.set_exception(error ? std::move(error) : std::move(batch_error));
+            }
+            else if constexpr (std::is_void_v<R>) {
+                promise.set_value();
+            }
+            else {
+                promise.set_value(std::move(*result));
+            }
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+    }
+
+    std::decay_t<F> fn;
+    std::promise<R> promise;
+    std::conditional_t<std::is_void_v<R>, bool, std::optional<R>> result = {};
+    std::exception_ptr error;
+};
+
+
+#endif // DATABASE_TASK_H
@@ -29,118 +29,1455 @@ SOFTWARE.
 #define SQLITE_DATABASE_H
 
 #include <sstream>
+#include <memory>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <string_view>
+#include <charconv>
+#include <tuple>
+#include <optional>
+#include <array>
+#include <memory_resource>
+#include <variant>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <cctype>
+#include <iterator>
+#include <algorithm>
+#include <cstddef>
 
 
 #define MAYTHROW noexcept(false)
 
 typedef struct sqlite3 sqlite3;
 typedef struct sqlite3_stmt sqlite3_stmt;
+typedef struct sqlite3_mem_methods sqlite3_mem_methods;
+typedef struct sqlite3_context sqlite3_context;
+typedef struct sqlite3_value sqlite3_value;
 class SqliteDatabase;
+class QueryProfiler;
+class SlowQueryLog;
+class ResultCache;
+class ChangeCapture;
+template<typename... Ts>
+class QueryRows;
+
+
+
+// Maps struct fields to result columns and insert values in declaration order.
+// Has to be used in the global namespace:
+//     struct User { int64_t id; std::string name; };
+//     SQLITE_MAP(User, id, name)
+//     auto users = query.fetch_all<User>();
+template<typename T>
+struct SqliteMapping;
+
+template<typename T, typename = void>
+struct is_sqlite_mapped : std::false_type
+{
+
+};
+
+template<typename T>
+struct is_sqlite_mapped<T, std::void_t<decltype(SqliteMapping<T>::fields())>> : std::true_type
+{
+
+};
+
+template<typename T>
+inline constexpr bool is_sqlite_mapped_v = is_sqlite_mapped<T>::value;
+
+template<typename T>
+inline constexpr bool is_sqlite_optional_v = false;
+
+template<typename T>
+inline constexpr bool is_sqlite_optional_v<std::optional<T>> = true;
+
+#define SQLITE_MAP(Struct, ...) \
+    template<> \
+    struct SqliteMapping<Struct> \
+    { \
+        static constexpr auto fields() noexcept \
+        { \
+            return std::make_tuple(SQLITE_MAP_EXPAND(SQLITE_MAP_CONCAT(SQLITE_MAP_FIELD_, SQLITE_MAP_COUNT(__VA_ARGS__))(Struct, __VA_ARGS__))); \
+        } \
+        static constexpr const char *names() noexcept \
+        { \
+            return #__VA_ARGS__; \
+        } \
+    };
+
+#define SQLITE_MAP_EXPAND(x) x
+#define SQLITE_MAP_COUNT_IMPL(_1,_2,_3,_4,_5,_6,_7,_8,_9,_10,_11,_12,_13,_14,_15,_16,_17,_18,_19,_20,_21,_22,_23,_24,_25,_26,_27,_28,_29,_30,_31,_32, N, ...) N
+#define SQLITE_MAP_COUNT(...) SQLITE_MAP_EXPAND(SQLITE_MAP_COUNT_IMPL(__VA_ARGS__, 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+#define SQLITE_MAP_CONCAT_IMPL(a, b) a##b
+#define SQLITE_MAP_CONCAT(a, b) SQLITE_MAP_CONCAT_IMPL(a, b)
+#define SQLITE_MAP_FIELD_1(S, f) &S::f
+#define SQLITE_MAP_FIELD_2(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_1(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_3(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_2(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_4(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_3(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_5(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_4(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_6(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_5(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_7(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_6(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_8(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_7(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_9(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_8(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_10(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_9(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_11(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_10(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_12(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_11(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_13(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_12(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_14(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_13(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_15(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_14(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_16(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_15(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_17(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_16(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_18(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_17(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_19(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_18(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_20(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_19(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_21(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_20(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_22(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_21(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_23(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_22(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_24(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_23(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_25(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_24(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_26(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_25(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_27(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_26(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_28(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_27(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_29(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_28(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_30(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_29(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_31(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_30(S, __VA_ARGS__))
+#define SQLITE_MAP_FIELD_32(S, f, ...) &S::f, SQLITE_MAP_EXPAND(SQLITE_MAP_FIELD_31(S, __VA_ARGS__))
+
+// Splits the SQLITE_MAP field list into column names
+inline std::vector<std::string> sqlite_mapping_columns(const char *names)
+{
+    std::vector<std::string> result;
+    std::string name;
+    for (; ; ++names) {
+        if (!*names || *names == ',') {
+            result.push_back(std::move(name));
+            name.clear();
+            if (!*names) {
+                return result;
+            }
+        }
+        else if (!isspace(static_cast<unsigned char>(*names))) {
+            name += *names;
+        }
+    }
+}
+
+
+
+// Latencies are bucketed by powers of two: bucket i counts values in [2^i, 2^(i+1)) nanoseconds
+using LatencyHistogram = std::array<uint64_t, 40>;
+
+struct StatementProfile
+{
+    std::string sql;
+    // prepare() calls, including statement cache hits
+    uint64_t prepare_count = 0;
+    uint64_t prepare_ns = 0;
+    uint64_t step_count = 0;
+    uint64_t step_ns = 0;
+    LatencyHistogram step_histogram = {};
+    uint64_t rows = 0;
+    // statement runs reported by sqlite3_trace_v2, including exec() and transaction control statements
+    uint64_t run_count = 0;
+    uint64_t run_ns = 0;
+    // sqlite3_stmt_status counters, collected when a query releases its statement
+    uint64_t vm_steps = 0;
+    uint64_t fullscan_steps = 0;
+    uint64_t sorts = 0;
+    uint64_t autoindexes = 0;
+};
+
+struct DatabaseProfile
+{
+    std::vector<StatementProfile> statements;
+    uint64_t commit_count = 0;
+    uint64_t commit_ns = 0;
+    LatencyHistogram commit_histogram = {};
+};
+
+
+
+// One row of EXPLAIN QUERY PLAN. parent is the id of the enclosing step, 0 at the top level
+struct QueryPlanStep
+{
+    int id = 0;
+    int parent = 0;
+    std::string detail;
+};
+
+struct QueryPlan
+{
+    std::vector<QueryPlanStep> steps;
+
+    // Steps reading a whole table or a whole index, e.g. "SCAN TABLE users". Virtual tables aren't counted
+    bool has_full_scan() const noexcept;
+    // Steps indented by nesting level, one per line
+    std::string to_string() const;
+};
+
+// Statement reported by the slow query log
+struct SlowQuery
+{
+    std::string sql;
+    // the sql with the bound values
+    std::string expanded_sql;
+    QueryPlan plan;
+    uint64_t run_ns = 0;          // time spent in sqlite3_step during the run
+    uint64_t fullscan_steps = 0;  // SQLITE_STMTSTATUS_FULLSCAN_STEP since the statement was prepared
+};
+
+struct SlowQueryOptions
+{
+    std::chrono::microseconds threshold = std::chrono::milliseconds(100);
+    // Report statements that have stepped through a full table scan regardless of the time
+    bool report_full_scans = true;
+    // Writes to std::cerr if empty
+    std::function<void(const SlowQuery &)> logger;
+};
+
+
+
+// Growable null-terminated text buffer with inline storage for short SQL.
+// clear() keeps the allocated capacity so the buffer can be reused
+class SqlBuffer
+{
+public:
+    SqlBuffer() noexcept;
+    ~SqlBuffer();
+    SqlBuffer(const SqlBuffer &) = delete;
+    SqlBuffer &operator=(const SqlBuffer &) = delete;
+
+    inline void append(char c)
+    {
+        if (length == capacity) {
+            grow(length + 1);
+        }
+        buffer[length++] = c;
+        buffer[length] = '\0';
+    }
+    void append(const char *str, size_t len);
+    inline void append(std::string_view str)
+    {
+        append(str.data(), str.size());
+    }
+    template<typename T>
+    void append_number(T value)
+    {
+        char tmp[64];
+        const auto res = std::to_chars(tmp, tmp + sizeof(tmp), value);
+        append(tmp, res.ptr - tmp);
+    }
+    // Appends a space unless the buffer is empty or already ends with a whitespace
+    void append_separator();
+
+    inline void clear() noexcept
+    {
+        length = 0;
+        buffer[0] = '\0';
+    }
+    inline const char *data() const noexcept
+    {
+        return buffer;
+    }
+    inline size_t size() const noexcept
+    {
+        return length;
+    }
+    inline bool empty() const noexcept
+    {
+        return !length;
+    }
+    inline char back() const noexcept
+    {
+        return length ? buffer[length - 1] : '\0';
+    }
+    inline std::string_view view() const noexcept
+    {
+        return {buffer, length};
+    }
+
+private:
+    void grow(size_t required);
+
+    static constexpr size_t inline_size = 128;
+    char *buffer;
+    size_t length = 0;
+    size_t capacity = inline_size - 1; // excluding the null terminator
+    char storage[inline_size];
+};
+
+
+
+// Bump allocator. Memory is released only by reset() or destruction.
+// reset() keeps the largest chunk, so a steady workload stops allocating after warm up
+class MonotonicArena : public std::pmr::memory_resource
+{
+public:
+    MonotonicArena(size_t initial_size = 4096) noexcept;
+    ~MonotonicArena();
+    MonotonicArena(const MonotonicArena &) = delete;
+    MonotonicArena &operator=(const MonotonicArena &) = delete;
+
+    void reset() noexcept;
+
+private:
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *p, size_t bytes, size_t alignment) noexcept override;
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+
+    struct alignas(std::max_align_t) Chunk
+    {
+        Chunk *next;
+    };
+
+    Chunk *chunks = nullptr;
+    char *ptr = nullptr;
+    char *end = nullptr;
+    size_t next_size;
+};
+
+
+
+// Result code of the non-throwing calls, e.g. Query::try_step(). Copying doesn't allocate,
+// the message is looked up only when it's asked for
+class DatabaseStatus
+{
+public:
+    DatabaseStatus(int code, sqlite3 *db = nullptr) noexcept;
+
+    // Extended result code, e.g. SQLITE_CONSTRAINT_UNIQUE
+    inline int get_code() const noexcept
+    {
+        return code;
+    }
+    inline int get_primary_code() const noexcept
+    {
+        return code & 0xff;
+    }
+
+    // SQLITE_ROW
+    bool has_row() const noexcept;
+    // SQLITE_DONE or SQLITE_OK
+    bool is_done() const noexcept;
+    bool is_error() const noexcept;
+    bool is_constraint() const noexcept;
+    bool is_busy() const noexcept;
+
+    // The connection message while it still describes this error, otherwise the generic text of the code
+    const char *get_message() const noexcept;
+
+private:
+    int code;
+    sqlite3 *db;
+};
+
+
+
+// Non-owning view of a blob column. Valid until the next step(), reset() or destruction of the query
+class BlobView
+{
+public:
+    BlobView() noexcept = default;
+    BlobView(const void *data, size_t size) noexcept :
+        ptr(static_cast<const uint8_t *>(data)), length(size)
+    {
+
+    }
+
+    inline const uint8_t *data() const noexcept
+    {
+        return ptr;
+    }
+    inline size_t size() const noexcept
+    {
+        return length;
+    }
+    inline bool empty() const noexcept
+    {
+        return !length;
+    }
+    inline const uint8_t *begin() const noexcept
+    {
+        return ptr;
+    }
+    inline const uint8_t *end() const noexcept
+    {
+        return ptr + length;
+    }
+    inline uint8_t operator[](size_t idx) const noexcept
+    {
+        return ptr[idx];
+    }
+
+private:
+    const uint8_t *ptr = nullptr;
+    size_t length = 0;
+};
+
+
+
+// Element types of containers bound by Query::bind() as one blob instead of a value per element
+template<typename T>
+inline constexpr bool is_sqlite_byte_v = std::is_same_v<T, uint8_t> || std::is_same_v<T, char> || std::is_same_v<T, std::byte>;
+
+template<typename T, typename = void>
+struct is_sqlite_contiguous : std::false_type
+{
+
+};
+
+template<typename T>
+struct is_sqlite_contiguous<T, std::void_t<decltype(std::data(std::declval<const T &>()))>> : std::true_type
+{
+
+};
+
+// Value types accepted by Query::bind(): numbers, strings, blobs, optionals and containers of them
+template<typename T, typename = void>
+struct is_sqlite_bindable : std::bool_constant<std::is_arithmetic_v<T> || std::is_convertible_v<const T &, std::string_view>>
+{
+
+};
+
+template<typename T>
+struct is_sqlite_bindable<std::optional<T>> : is_sqlite_bindable<T>
+{
+
+};
+
+template<typename T>
+struct is_sqlite_bindable<T, std::enable_if_t<!std::is_convertible_v<const T &, std::string_view>,
+                                              decltype(void(std::begin(std::declval<const T &>())))>> :
+    is_sqlite_bindable<std::decay_t<decltype(*std::begin(std::declval<const T &>()))>>
+{
+
+};
+
+
+
+// Decoded rows of Query::fetch_cached(). Values are kept in a cell per column with text and blobs packed into one buffer
+class CachedResult
+{
+    friend class Query;
+
+public:
+    // Same values as the sqlite fundamental datatypes
+    enum Type : uint8_t
+    {
+        Integer = 1,
+        Float,
+        Text,
+        Blob,
+        Null,
+    };
+
+    inline size_t size() const noexcept
+    {
+        return rows;
+    }
+    inline bool empty() const noexcept
+    {
+        return !rows;
+    }
+    inline size_t get_column_count() const noexcept
+    {
+        return columns;
+    }
+    inline Type get_type(size_t row, size_t col) const noexcept
+    {
+        return static_cast<Type>(types[row * columns + col]);
+    }
+    inline bool is_null(size_t row, size_t col) const noexcept
+    {
+        return get_type(row, col) == Null;
+    }
+
+    // Numbers are converted like sqlite does, NULL is 0
+    int64_t get_int64(size_t row, size_t col) const noexcept;
+    double get_double(size_t row, size_t col) const noexcept;
+    std::string get_string(size_t row, size_t col) const;
+    // Empty for numbers and NULL
+    std::string_view get_string_view(size_t row, size_t col) const noexcept;
+    BlobView get_blob(size_t row, size_t col) const noexcept;
+
+    size_t get_memory_usage() const noexcept;
+
+private:
+    void add_row(sqlite3_stmt *stmt);
+
+    union Cell
+    {
+        int64_t integer;
+        double real;
+        struct
+        {
+            uint32_t offset;
+            uint32_t length;
+        } bytes;
+    };
+
+    size_t columns = 0;
+    size_t rows = 0;
+    std::vector<uint8_t> types;
+    std::vector<Cell> cells;
+    std::string data;
+};
+
+struct ResultCacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t invalidations = 0;  // entries dropped because a table they read has changed
+    uint64_t evictions = 0;      // entries dropped to fit into the memory limit
+    size_t entries = 0;
+    size_t memory_usage = 0;     // bytes
+    size_t memory_limit = 0;
+
+    inline double hit_ratio() const noexcept
+    {
+        return hits + misses ? static_cast<double>(hits) / static_cast<double>(hits + misses) : 0;
+    }
+};
+
+
+
+// Result rows stored column by column.
+// The type of each column is taken from its first non-NULL value in the batch,
+// the following values of the column are converted to that type
+class ColumnBatch
+{
+    friend class Query;
+
+public:
+    // Same values as the sqlite fundamental datatypes
+    enum Type
+    {
+        Integer = 1,
+        Float = 2,
+        Text = 3,
+        Blob = 4,
+        Null = 5,
+    };
+
+    class Column
+    {
+        friend class Query;
+        friend class ColumnBatch;
+
+    public:
+        inline Type type() const noexcept
+        {
+            return column_type;
+        }
+        inline bool is_null(size_t row) const noexcept
+        {
+            return nulls[row / 64] & (uint64_t(1) << (row % 64));
+        }
+        // Only filled for Integer columns
+        inline const std::vector<int64_t> &integers() const noexcept
+        {
+            return integer_values;
+        }
+        // Only filled for Float columns
+        inline const std::vector<double> &reals() const noexcept
+        {
+            return real_values;
+        }
+        // Text and Blob columns keep all values in one buffer
+        inline std::string_view text(size_t row) const noexcept
+        {
+            return {data.data() + offsets[row], offsets[row + 1] - offsets[row]};
+        }
+        inline BlobView blob(size_t row) const noexcept
+        {
+            return {data.data() + offsets[row], offsets[row + 1] - offsets[row]};
+        }
+
+    private:
+        void clear() noexcept;
+        void set_type(Type type, size_t rows);
+
+        Type column_type = Null;
+        std::vector<uint64_t> nulls;
+        std::vector<int64_t> integer_values;
+        std::vector<double> real_values;
+        std::vector<size_t> offsets;
+        std::vector<char> data;
+    };
+
+    inline size_t size() const noexcept
+    {
+        return rows;
+    }
+    inline bool empty() const noexcept
+    {
+        return !rows;
+    }
+    inline size_t column_count() const noexcept
+    {
+        return columns.size();
+    }
+    inline const Column &column(size_t idx) const noexcept
+    {
+        return columns[idx];
+    }
+
+    // Keeps the allocated buffers for the next batch
+    void clear() noexcept;
+
+private:
+    std::vector<Column> columns;
+    size_t rows = 0;
+};
 
 
 
 class Query
 {
-    friend class SqliteDatabase;
+    friend class SqliteDatabase;
+    template<const char *, typename, typename...>
+    friend class TypedQuery;
+    template<typename... Ts>
+    friend class QueryRows;
+
+public:
+    ~Query();
+    Query(const Query &) = delete;
+    Query &operator=(const Query &) = delete;
+
+    Query &operator<<(const char *value);
+    Query &operator<<(const std::string &value);
+
+    inline Query &operator<<(Query &(*pf)(Query &))
+    {
+        return pf(*this);
+    }
+    template<typename T>
+    Query &operator<<(const T &value)
+    {
+        sql.append_separator();
+        if constexpr (std::is_same_v<T, bool>) {
+            sql.append(value ? '1' : '0');
+        }
+        else if constexpr (std::is_same_v<T, char>) {
+            sql.append(value);
+        }
+        else if constexpr (std::is_arithmetic_v<T>) {
+            sql.append_number(value);
+        }
+        else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+            sql.append(std::string_view(value));
+        }
+        else {
+            std::ostringstream os;
+            os << value;
+            sql.append(os.str());
+        }
+        return *this;
+    }
+
+    Query &add_array(size_t columns) MAYTHROW;
+    Query &add_array(size_t columns, size_t rows) MAYTHROW;
+
+    // constant = true binds without a copy: the caller keeps the value alive and unchanged
+    // until it's rebound, the bindings are cleared or the query is reset.
+    // Rvalue strings and blobs are moved into the query. A parameter keeps only its last moved value,
+    // including across rerun(). It's freed when the parameter is rebound with another moved value or with bind_at(),
+    // when the bindings are cleared or the query is reset
+    Query &bind(const char *str, bool constant = false) MAYTHROW;
+    Query &bind(const std::string &str, bool constant = false) MAYTHROW;
+    Query &bind(std::string &&str) MAYTHROW;
+    Query &bind(std::string_view str, bool constant = false) MAYTHROW;
+    Query &bind(int32_t value) MAYTHROW;
+    Query &bind(uint32_t value) MAYTHROW;
+    Query &bind(int64_t value) MAYTHROW;
+    Query &bind(uint64_t value) MAYTHROW;
+    Query &bind(double value) MAYTHROW;
+    Query &bind(BlobView blob, bool constant = false) MAYTHROW;
+    Query &bind() MAYTHROW;
+
+    // Non-throwing binds for the hot paths. Only a SQL error while preparing the statement still throws
+    DatabaseStatus try_bind(std::string_view str, bool constant = false) MAYTHROW;
+    DatabaseStatus try_bind(int64_t value) MAYTHROW;
+    DatabaseStatus try_bind(uint64_t value) MAYTHROW;
+    DatabaseStatus try_bind(double value) MAYTHROW;
+    DatabaseStatus try_bind(BlobView blob, bool constant = false) MAYTHROW;
+    DatabaseStatus try_bind() MAYTHROW;
+
+    template<typename T>
+    std::enable_if_t<std::is_arithmetic_v<T>, DatabaseStatus> try_bind(T value) MAYTHROW
+    {
+        if constexpr (std::is_floating_point_v<T>) {
+            return try_bind(static_cast<double>(value));
+        }
+        else if constexpr (std::is_signed_v<T> || std::is_same_v<T, bool>) {
+            return try_bind(static_cast<int64_t>(value));
+        }
+        else {
+            return try_bind(static_cast<uint64_t>(value));
+        }
+    }
+
+    template<typename T>
+    DatabaseStatus try_bind(const std::optional<T> &value) MAYTHROW
+    {
+        return value ? try_bind(*value) : try_bind();
+    }
+
+    Query &bind_blob(const void *data, size_t size, bool constant = false) MAYTHROW;
+    Query &bind_blob(const std::vector<uint8_t> &blob, bool constant = false) MAYTHROW;
+    Query &bind_blob(std::vector<uint8_t> &&blob) MAYTHROW;
+    // sqlite takes the ownership of the buffer and deletes it when it's no longer needed
+    Query &bind_blob(std::unique_ptr<uint8_t[]> data, size_t size) MAYTHROW;
+    Query &bind_zeroblob(uint64_t size) MAYTHROW;
+
+    // Other arithmetic types are widened to int64_t, uint64_t or double
+    template<typename T>
+    std::enable_if_t<std::is_arithmetic_v<T>, Query &> bind(T value) MAYTHROW
+    {
+        if constexpr (std::is_floating_point_v<T>) {
+            return bind(static_cast<double>(value));
+        }
+        else if constexpr (std::is_signed_v<T> || std::is_same_v<T, bool>) {
+            return bind(static_cast<int64_t>(value));
+        }
+        else {
+            return bind(static_cast<uint64_t>(value));
+        }
+    }
+
+    // Binds NULL for an empty optional
+    template<typename T>
+    Query &bind(const std::optional<T> &value) MAYTHROW
+    {
+        return value ? bind(*value) : bind();
+    }
+    // Binds the array as a blob of fixed-width little-endian int64 values, readable with get_int64_array()
+    Query &bind_int64_array(const int64_t *data, size_t size, bool constant = false) MAYTHROW;
+    Query &bind_int64_array(const std::vector<int64_t> &array, bool constant = false) MAYTHROW;
+
+    template<typename Iterator>
+    Query &bind(Iterator begin, Iterator end)
+    {
+        for (; begin != end; ++begin) {
+            bind(*begin);
+        }
+        return *this;
+    }
+
+    // Binds a value per element. Contiguous containers of bytes, e.g. std::array<uint8_t, 16>, are bound as one blob
+    template<typename Container,
+             typename = decltype(std::begin(std::declval<const Container &>())),
+             typename = std::enable_if_t<!std::is_convertible_v<const Container &, std::string_view>>>
+    Query &bind(const Container &container)
+    {
+        using Element = std::decay_t<decltype(*std::begin(container))>;
+        if constexpr (is_sqlite_byte_v<Element> && is_sqlite_contiguous<Container>::value) {
+            return bind_blob(std::data(container), std::size(container));
+        }
+        else if constexpr (is_sqlite_byte_v<Element>) {
+            static_assert(sizeof(Container) == 0, "Byte containers have to be contiguous to be bound as a blob");
+        }
+        else {
+            static_assert(is_sqlite_bindable<Element>::value, "Container elements can't be bound");
+            return bind(std::begin(container), std::end(container));
+        }
+    }
+
+    // Binds to the 1-based parameter index with any of the bind() overloads.
+    // The sequential bind() position isn't changed. A value previously moved into the parameter is freed
+    template<typename... Args>
+    Query &bind_at(int idx, Args &&...args) MAYTHROW
+    {
+        const auto saved_idx = bind_idx;
+        auto previous = take_owned_value(idx);
+        bind_idx = idx - 1;
+        try {
+            bind(std::forward<Args>(args)...);
+        } catch (...) {
+            bind_idx = saved_idx;
+            restore_owned_value(idx, std::move(previous));
+            throw;
+        }
+        bind_idx = saved_idx;
+        return *this;
+    }
+
+    // Binds a named parameter (:name, @name or $name). The index is resolved once per prepared statement
+    template<typename... Args>
+    Query &bind_named(std::string_view name, Args &&...args) MAYTHROW
+    {
+        return bind_at(get_parameter_index(name), std::forward<Args>(args)...);
+    }
+
+    int get_parameter_index(std::string_view name) MAYTHROW;
+
+    bool step() MAYTHROW;
+    static Query &step(Query &query) MAYTHROW;
+    // Returns errors instead of throwing, e.g. to treat constraint violations as an expected outcome.
+    // The statement can be stepped again after an error. Only a SQL error while preparing still throws
+    DatabaseStatus try_step() MAYTHROW;
+
+    Query &reset() noexcept;
+    Query &clear_bindings() noexcept;
+    // Resets the statement for the next execution and keeps all bound values
+    Query &rerun() noexcept;
+
+    bool is_null() const noexcept;
+    Query &skip() MAYTHROW;
+    std::string get_string() MAYTHROW;
+    std::pmr::string get_string(std::pmr::memory_resource *resource) MAYTHROW;
+    // The views are valid until the next step(), reset() or destruction of the query
+    std::string_view get_string_view() MAYTHROW;
+    BlobView get_blob() MAYTHROW;
+    int32_t get_int32() MAYTHROW;
+    uint32_t get_uint32() MAYTHROW;
+    int64_t get_int64() MAYTHROW;
+    uint64_t get_uint64() MAYTHROW;
+    double get_double() MAYTHROW;
+    // Reads either a delimited text array or a blob written by bind_int64_array()
+    std::vector<int64_t> get_int64_array(char delimiter = ',') MAYTHROW;
+    std::pmr::vector<int64_t> get_int64_array(std::pmr::memory_resource *resource, char delimiter = ',') MAYTHROW;
+
+    // Per-query arena for materialized results, e.g. query.get_string(query.get_arena()).
+    // It's reset on every step(), so everything allocated in it is valid until the next step()
+    MonotonicArena *get_arena();
+
+    // Steps to the next row and decodes it into a struct registered with SQLITE_MAP
+    template<typename T>
+    bool fetch(T &row) MAYTHROW
+    {
+        constexpr auto fields = SqliteMapping<T>::fields();
+        constexpr auto count = std::tuple_size_v<decltype(fields)>;
+        if (!step()) {
+            return false;
+        }
+        check_column_count(count);
+        read_fields(row, fields, std::make_index_sequence<count>());
+        return true;
+    }
+
+    // Decodes all remaining rows. Rows are decoded in place, without per-row temporaries
+    template<typename T>
+    std::vector<T> fetch_all(size_t reserve = 0) MAYTHROW
+    {
+        constexpr auto fields = SqliteMapping<T>::fields();
+        constexpr auto count = std::tuple_size_v<decltype(fields)>;
+        std::vector<T> result;
+        result.reserve(reserve);
+        if (!stmt) {
+            prepare();
+        }
+        check_column_count(count);
+        while (step()) {
+            read_fields(result.emplace_back(), fields, std::make_index_sequence<count>());
+        }
+        return result;
+    }
+
+    // Lazy input range over the remaining rows, one step() per increment:
+    //     for (auto [id, name] : query.rows<int64_t, std::string_view>()) { ... }
+    // A single type yields values, a struct registered with SQLITE_MAP yields structs,
+    // several types yield tuples
+    template<typename... Ts>
+    QueryRows<Ts...> rows() MAYTHROW
+    {
+        return QueryRows<Ts...>(*this);
+    }
+
+    // Returns the whole result from the connection's result cache, or executes the query and caches it.
+    // Uncached if the cache is disabled, the statement writes or calls a function that isn't a known deterministic
+    // builtin or registered as deterministic. The statement isn't stepped on a hit
+    std::shared_ptr<const CachedResult> fetch_cached() MAYTHROW;
+
+    // Steps up to n rows into the batch. Returns the number of fetched rows, 0 when the result is exhausted.
+    // Reusing the same batch keeps the allocator traffic near zero
+    size_t fetch_batch(ColumnBatch &batch, size_t n) MAYTHROW;
+    ColumnBatch fetch_batch(size_t n) MAYTHROW;
+
+    // EXPLAIN QUERY PLAN of the sql. The statement itself isn't touched and may be in the middle of a run
+    QueryPlan explain_plan() const MAYTHROW;
+
+    std::shared_ptr<SqliteDatabase> get_database() const noexcept;
+
+private:
+    void prepare() MAYTHROW;
+    void release() noexcept;
+    using OwnedValue = std::variant<std::monostate, std::string, std::vector<uint8_t>>;
+    // Moves value into the slot of the 1-based parameter idx. The previous value is returned,
+    // it has to be kept until the new one is bound
+    OwnedValue own_value(int idx, OwnedValue value) MAYTHROW;
+    // Empties the slot of idx if there's one. Used by bind_at() until the parameter is rebound
+    OwnedValue take_owned_value(int idx) noexcept;
+    void restore_owned_value(int idx, OwnedValue value) noexcept;
+    // Keeps the exact value bound to the current parameter for the result cache key: type and raw bytes
+    void record_binding(int type, const void *data, size_t size) noexcept;
+    // sqlite3_step with the profiling and the slow query log
+    int execute_step() noexcept;
+    // Reports the run to the slow query log. Called when a run ends or is abandoned
+    void finish_run() noexcept;
+    template<typename Vector>
+    void read_int64_array(Vector &result, char delimiter) MAYTHROW;
+    Query(std::shared_ptr<SqliteDatabase> database);
+
+    // Unchecked column accessors. Used by TypedQuery after the column count has been validated
+    int64_t column_int64(int idx) const noexcept;
+    double column_double(int idx) const noexcept;
+    bool column_is_null(int idx) const noexcept;
+    std::string column_string(int idx) const;
+    std::string_view column_string_view(int idx) const noexcept;
+    BlobView column_blob(int idx) const noexcept;
+
+    template<typename T>
+    T column_value(int idx) const
+    {
+        if constexpr (is_sqlite_optional_v<T>) {
+            if (column_is_null(idx)) {
+                return std::nullopt;
+            }
+            return column_value<typename T::value_type>(idx);
+        }
+        else if constexpr (std::is_same_v<T, std::string>) {
+            return column_string(idx);
+        }
+        else if constexpr (std::is_same_v<T, std::string_view>) {
+            return column_string_view(idx);
+        }
+        else if constexpr (std::is_same_v<T, BlobView>) {
+            return column_blob(idx);
+        }
+        else if constexpr (std::is_floating_point_v<T>) {
+            return static_cast<T>(column_double(idx));
+        }
+        else if constexpr (std::is_integral_v<T>) {
+            return static_cast<T>(column_int64(idx));
+        }
+        else {
+            static_assert(sizeof(T) == 0, "Unsupported column type");
+        }
+    }
+
+    void check_column_count(size_t count) MAYTHROW;
+
+    template<typename T, typename Fields, size_t... I>
+    inline void read_fields(T &row, const Fields &fields, std::index_sequence<I...>) const
+    {
+        ((row.*std::get<I>(fields) = column_value<std::remove_reference_t<decltype(row.*std::get<I>(fields))>>(I)), ...);
+    }
+
+    std::shared_ptr<SqliteDatabase> database;
+    SqlBuffer sql;
+    sqlite3_stmt *stmt = nullptr;
+    StatementProfile *profile = nullptr;
+    SlowQueryLog *slow_log = nullptr;
+    uint64_t run_ns = 0;
+    std::unique_ptr<MonotonicArena> arena;
+    // Values moved into the query by bind(), one slot per parameter index, sized once per prepared statement
+    std::vector<OwnedValue> owned_values;
+    // Bound values while the result cache is enabled, see record_binding()
+    std::vector<std::string> bound_values;
+    bool untracked_bindings = false;
+    std::vector<std::pair<std::string, int>> parameter_indexes;
+    int bind_idx = 0;
+    int col_idx = 0;
+    int col_count = 0;
+    bool done = false;
+};
+
+
+
+// Range returned by Query::rows(). Each increment steps the query, rows are decoded on dereference
+template<typename... Ts>
+class QueryRows
+{
+    static_assert(sizeof...(Ts) > 0, "At least one column type is required");
+
+    template<typename T, typename... Rest>
+    struct First
+    {
+        using type = T;
+    };
+    using Front = typename First<Ts...>::type;
+    static constexpr bool mapped = sizeof...(Ts) == 1 && is_sqlite_mapped_v<Front>;
+
+public:
+    using value_type = std::conditional_t<sizeof...(Ts) == 1, Front, std::tuple<Ts...>>;
+
+    class iterator
+    {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = QueryRows::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = value_type;
+
+        iterator() noexcept = default;
+
+        // Decodes the current row. Views are valid until the next increment
+        value_type operator*() const
+        {
+            return QueryRows::decode(*query);
+        }
+
+        iterator &operator++() MAYTHROW
+        {
+            if (!query->step()) {
+                query = nullptr;
+            }
+            return *this;
+        }
+
+        inline void operator++(int) MAYTHROW
+        {
+            ++*this;
+        }
+
+        inline bool operator==(const iterator &other) const noexcept
+        {
+            return query == other.query;
+        }
+
+        inline bool operator!=(const iterator &other) const noexcept
+        {
+            return query != other.query;
+        }
+
+    private:
+        friend class QueryRows;
+        explicit iterator(Query *query) noexcept :
+            query(query)
+        {
+
+        }
+
+        Query *query = nullptr;
+    };
+
+    explicit QueryRows(Query &query) MAYTHROW :
+        query(query)
+    {
+        if (!query.stmt) {
+            query.prepare();
+        }
+        if constexpr (mapped) {
+            query.check_column_count(std::tuple_size_v<decltype(SqliteMapping<Front>::fields())>);
+        }
+        else {
+            query.check_column_count(sizeof...(Ts));
+        }
+    }
+
+    // Leaving the loop early resets the statement, so the vm stops right away
+    // and releases its locks. The bindings are kept
+    ~QueryRows()
+    {
+        if (!query.done) {
+            query.rerun();
+        }
+    }
+
+    QueryRows(const QueryRows &) = delete;
+    QueryRows &operator=(const QueryRows &) = delete;
+
+    // Steps to the first row
+    iterator begin() MAYTHROW
+    {
+        return query.step() ? iterator(&query) : iterator();
+    }
+
+    inline iterator end() const noexcept
+    {
+        return iterator();
+    }
+
+private:
+    static value_type decode(const Query &query)
+    {
+        if constexpr (mapped) {
+            constexpr auto fields = SqliteMapping<Front>::fields();
+            value_type row{};
+            query.read_fields(row, fields, std::make_index_sequence<std::tuple_size_v<decltype(fields)>>());
+            return row;
+        }
+        else if constexpr (sizeof...(Ts) == 1) {
+            return query.template column_value<Front>(0);
+        }
+        else {
+            return decode_tuple(query, std::index_sequence_for<Ts...>());
+        }
+    }
+
+    template<size_t... I>
+    static value_type decode_tuple(const Query &query, std::index_sequence<I...>)
+    {
+        return value_type{query.template column_value<Ts>(I)...};
+    }
+
+    Query &query;
+};
+
+
+
+// Transactions may be nested. The outermost one issues BEGIN/COMMIT,
+// nested ones (or any transaction started inside a manual BEGIN) use SAVEPOINT/RELEASE
+class Transaction
+{
+    friend class SqliteDatabase;
+
+public:
+    ~Transaction() MAYTHROW;
+    Transaction(const Transaction &) = delete;
+    Transaction &operator=(const Transaction &) = delete;
+
+    void commit() MAYTHROW;
+    void rollback() MAYTHROW;
+
+private:
+    Transaction(std::shared_ptr<SqliteDatabase> database) MAYTHROW;
+
+    std::shared_ptr<SqliteDatabase> database;
+    const int exception_count;
+    size_t level;
+    bool savepoint;
+};
+
+
+
+// Buffers rows and inserts them with a multi-row INSERT ... VALUES (?,?),(?,?)... statement.
+// The last partial batch is inserted on flush with a one-off statement sized to it.
+// When commit_rows isn't 0 the inserter wraps batches into transactions committed every commit_rows rows
+class BulkInserter
+{
+    friend class SqliteDatabase;
+
+public:
+    ~BulkInserter() MAYTHROW;
+    BulkInserter(const BulkInserter &) = delete;
+    BulkInserter &operator=(const BulkInserter &) = delete;
+
+    // Takes either one value per column or a single struct registered with SQLITE_MAP
+    template<typename... Args>
+    BulkInserter &insert(const Args &...values) MAYTHROW
+    {
+        if constexpr (sizeof...(Args) == 1 && (is_sqlite_mapped_v<Args> && ...)) {
+            (add_fields(values, SqliteMapping<Args>::fields()), ...);
+        }
+        else {
+            (add_value(values), ...);
+        }
+        next_row();
+        return *this;
+    }
+
+    // Inserts pending rows and commits the current transaction
+    void flush() MAYTHROW;
+
+    size_t get_batch_rows() const noexcept;
+    uint64_t get_row_count() const noexcept;
+
+private:
+    BulkInserter(std::shared_ptr<SqliteDatabase> database, const std::string &table,
+                 const std::vector<std::string> &columns, size_t batch_rows, size_t commit_rows) MAYTHROW;
+
+    template<typename T, typename Fields>
+    void add_fields(const T &row, const Fields &fields) MAYTHROW
+    {
+        std::apply([this, &row](const auto &...field) {
+            (add_value(row.*field), ...);
+        }, fields);
+    }
+
+    template<typename T>
+    void add_value(const T &value) MAYTHROW
+    {
+        if constexpr (std::is_same_v<T, std::nullptr_t>) {
+            set_null();
+        }
+        else if constexpr (is_sqlite_optional_v<T>) {
+            if (value) {
+                add_value(*value);
+            }
+            else {
+                set_null();
+            }
+        }
+        else if constexpr (std::is_same_v<T, uint64_t>) {
+            set_uint64(value);
+        }
+        else if constexpr (std::is_integral_v<T>) {
+            set_int64(value);
+        }
+        else if constexpr (std::is_floating_point_v<T>) {
+            set_double(value);
+        }
+        else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+            set_text(value);
+        }
+        else {
+            static_assert(sizeof(T) == 0, "Unsupported value type");
+        }
+    }
+
+    struct Value
+    {
+        int type;
+        int64_t integer;
+        double real;
+        std::string text;
+    };
+
+    Value &next_value() MAYTHROW;
+    void set_null() MAYTHROW;
+    void set_int64(int64_t value) MAYTHROW;
+    void set_uint64(uint64_t value) MAYTHROW;
+    void set_double(double value) MAYTHROW;
+    void set_text(std::string_view value) MAYTHROW;
+    void next_row() MAYTHROW;
+    // Binds the first rows pending values to stmt and executes it
+    void execute(sqlite3_stmt *stmt, size_t rows) MAYTHROW;
+    void commit_if_needed(size_t rows) MAYTHROW;
+    // INSERT statement with rows value tuples
+    std::string make_sql(size_t rows) const;
+
+    std::shared_ptr<SqliteDatabase> database;
+    std::unique_ptr<Transaction> transaction;
+    const int exception_count;
+    size_t column_count;
+    size_t batch_rows;
+    size_t commit_rows;
+    std::string insert_sql;
+    std::string row_sql;
+    std::string batch_sql;
+    sqlite3_stmt *batch_stmt = nullptr;
+    std::vector<Value> values;
+    size_t value_idx = 0;
+    size_t pending_rows = 0;
+    size_t uncommitted_rows = 0;
+    uint64_t row_count = 0;
+};
+
+
+
+// Retry policy for a locked database. Waits start at initial_delay and grow by multiplier up to max_delay,
+// each shortened by a random fraction up to jitter so that competing connections don't wake up together.
+// A lock acquisition gives up with SQLITE_BUSY once the total wait would exceed the deadline
+struct BusyStrategy
+{
+    std::chrono::microseconds initial_delay = std::chrono::microseconds(100);
+    std::chrono::microseconds max_delay = std::chrono::milliseconds(50);
+    double multiplier = 2;
+    double jitter = 0.5;
+    std::chrono::milliseconds deadline = std::chrono::milliseconds(5000);
+    // Restart read-only statements that failed with SQLITE_BUSY or SQLITE_LOCKED before returning a row.
+    // Covers the cases where sqlite doesn't call the busy handler, e.g. a WAL recovery or a locked table
+    bool retry_reads = true;
+};
 
-public:
-    ~Query();
-    Query(const Query &) = delete;
-    Query &operator=(const Query &) = delete;
+// Time spent waiting for locks since the connection was opened
+struct LockWaitStats
+{
+    uint64_t waits = 0;         // times the connection slept on a lock
+    uint64_t wait_ns = 0;       // total sleep time
+    uint64_t timeouts = 0;      // lock acquisitions that have given up at the deadline
+    uint64_t step_retries = 0;  // read statements restarted after SQLITE_BUSY or SQLITE_LOCKED
+};
 
-    Query &operator<<(const char *value);
-    Query &operator<<(const std::string &value);
 
-    inline Query &operator<<(Query &(*pf)(Query &))
-    {
-        return pf(*this);
-    }
-    template<typename T>
-    Query &operator<<(const T &value)
+
+// Connection settings applied by SqliteDatabase::open() before the connection is handed out.
+// Empty or unset values keep the sqlite defaults
+struct OpenOptions
+{
+    bool read_only = false;
+    bool create = true;
+    bool no_mutex = false;
+    bool uri = false;
+
+    std::optional<int> page_size;       // bytes, only affects a new database
+    std::string journal_mode;           // DELETE, TRUNCATE, PERSIST, MEMORY, WAL, OFF
+    std::string synchronous;            // OFF, NORMAL, FULL, EXTRA
+    std::optional<int64_t> cache_size;  // pages if positive, KiB if negative
+    std::optional<int64_t> mmap_size;   // bytes
+    std::string temp_store;             // DEFAULT, FILE, MEMORY
+    std::optional<int> busy_timeout;    // milliseconds
+    std::optional<BusyStrategy> busy_strategy;  // replaces busy_timeout
+
+    // Fast loading of a database that can be rebuilt from scratch on failure
+    static OpenOptions bulk_load();
+    // Many concurrent readers with a single writer
+    static OpenOptions read_heavy();
+    // Every commit is synced to disk
+    static OpenOptions durable();
+};
+
+
+
+// Arguments and result of a user-defined function call. Views are valid until the function returns
+class FunctionContext
+{
+public:
+    FunctionContext(sqlite3_context *context, int argc, sqlite3_value **argv) noexcept;
+
+    inline int get_argument_count() const noexcept
     {
-        if (!ss.str().empty()) {
-            ss << ' ';
-        }
-        ss << value;
-        return *this;
+        return argc;
     }
 
-    Query &add_array(size_t columns) MAYTHROW;
-    Query &add_array(size_t columns, size_t rows) MAYTHROW;
+    bool is_null(int idx) const noexcept;
+    int64_t get_int64(int idx) const noexcept;
+    double get_double(int idx) const noexcept;
+    std::string_view get_string_view(int idx) const noexcept;
+    BlobView get_blob(int idx) const noexcept;
 
-    Query &bind(const char *str, bool constant = false) MAYTHROW;
-    Query &bind(const std::string &str, bool constant = false) MAYTHROW;
-    Query &bind(int32_t value) MAYTHROW;
-    Query &bind(uint32_t value) MAYTHROW;
-    Query &bind(int64_t value) MAYTHROW;
-    Query &bind(uint64_t value) MAYTHROW;
-    Query &bind() MAYTHROW;
+    void result_null() noexcept;
+    void result_int64(int64_t value) noexcept;
+    void result_double(double value) noexcept;
+    // Text and blobs are copied by sqlite
+    void result_text(std::string_view value) noexcept;
+    void result_blob(BlobView value) noexcept;
+    void result_error(const char *message) noexcept;
 
-    template<typename Iterator>
-    Query &bind(Iterator begin, Iterator end)
+    // Zero-initialized per-group memory of an aggregate, allocated on the first call
+    void *get_aggregate_state(size_t size) noexcept;
+    // Returns nullptr if get_aggregate_state() hasn't been called for the group
+    void *peek_aggregate_state() noexcept;
+
+    template<typename T>
+    T get(int idx) const
     {
-        for (; begin != end; ++begin) {
-            bind(*begin);
+        if constexpr (is_sqlite_optional_v<T>) {
+            if (is_null(idx)) {
+                return std::nullopt;
+            }
+            return get<typename T::value_type>(idx);
+        }
+        else if constexpr (std::is_same_v<T, std::string_view>) {
+            return get_string_view(idx);
+        }
+        else if constexpr (std::is_same_v<T, std::string>) {
+            return std::string(get_string_view(idx));
+        }
+        else if constexpr (std::is_same_v<T, BlobView>) {
+            return get_blob(idx);
+        }
+        else if constexpr (std::is_same_v<T, bool>) {
+            return get_int64(idx) != 0;
+        }
+        else if constexpr (std::is_floating_point_v<T>) {
+            return static_cast<T>(get_double(idx));
+        }
+        else if constexpr (std::is_integral_v<T>) {
+            return static_cast<T>(get_int64(idx));
+        }
+        else {
+            static_assert(std::is_void_v<T>, "Unsupported function argument type");
         }
-        return *this;
     }
 
-    template<typename Container>
-    Query &bind(const Container &container)
+    template<typename T>
+    void set_result(const T &value)
     {
-        bind(container.begin(), container.end());
-        return *this;
+        if constexpr (is_sqlite_optional_v<T>) {
+            if (value) {
+                set_result(*value);
+            }
+            else {
+                result_null();
+            }
+        }
+        else if constexpr (std::is_same_v<T, std::nullptr_t>) {
+            result_null();
+        }
+        else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+            result_text(value);
+        }
+        else if constexpr (std::is_same_v<T, BlobView>) {
+            result_blob(value);
+        }
+        else if constexpr (std::is_same_v<T, std::vector<uint8_t>>) {
+            result_blob(BlobView(value.data(), value.size()));
+        }
+        else if constexpr (std::is_floating_point_v<T>) {
+            result_double(value);
+        }
+        else if constexpr (std::is_integral_v<T>) {
+            result_int64(static_cast<int64_t>(value));
+        }
+        else {
+            static_assert(std::is_void_v<T>, "Unsupported function result type");
+        }
     }
 
-    bool step() MAYTHROW;
-    static Query &step(Query &query) MAYTHROW;
+private:
+    sqlite3_context *context;
+    int argc;
+    sqlite3_value **argv;
+};
 
-    Query &reset() noexcept;
-    Query &clear_bindings() noexcept;
 
-    bool is_null() const noexcept;
-    Query &skip() MAYTHROW;
-    std::string get_string() MAYTHROW;
-    int32_t get_int32() MAYTHROW;
-    uint32_t get_uint32() MAYTHROW;
-    int64_t get_int64() MAYTHROW;
-    uint64_t get_uint64() MAYTHROW;
-    double get_double() MAYTHROW;
-    std::vector<int64_t> get_int64_array(char delimiter = ',') MAYTHROW;
 
-    std::shared_ptr<SqliteDatabase> get_database() const noexcept;
+// Type-erased user-defined function owned by sqlite. Scalar functions implement call(), aggregates step() and final()
+class UserFunction
+{
+public:
+    virtual ~UserFunction() = default;
+    virtual void call(FunctionContext &context);
+    virtual void step(FunctionContext &context);
+    virtual void final(FunctionContext &context);
+};
 
-private:
-    void prepare() MAYTHROW;
-    Query(std::shared_ptr<SqliteDatabase> database);
 
-    std::shared_ptr<SqliteDatabase> database;
-    std::stringstream ss;
-    sqlite3_stmt *stmt = nullptr;
-    int bind_idx = 0;
-    int col_idx = 0;
-    int col_count = 0;
+
+// Rows exposed to SQL by a read-only virtual table
+class VirtualTableSource
+{
+public:
+    virtual ~VirtualTableSource() = default;
+
+    virtual size_t size() const noexcept = 0;
+    virtual void column(size_t row, int idx, FunctionContext &context) const = 0;
+    // Number of leading rows with the sorted key less than the argument, or not greater when inclusive
+    virtual size_t partition_point(const FunctionContext &arguments, int idx, bool inclusive) const = 0;
+
+    // CREATE TABLE statement declaring the columns
+    std::string schema;
+    // Column sorted in ascending order, -1 if there is none
+    int key_column = -1;
+    // Text keys are searched with text arguments only, numeric keys with numeric ones
+    bool text_key = false;
 };
 
 
 
-class Transaction
+// Argument and result types of a function, a function pointer or a lambda
+template<typename F>
+struct SqliteFunctionTraits : SqliteFunctionTraits<decltype(&F::operator())>
 {
-    friend class SqliteDatabase;
 
-public:
-    ~Transaction() MAYTHROW;
-    Transaction(const Transaction &) = delete;
-    Transaction &operator=(const Transaction &) = delete;
+};
 
-    void commit() MAYTHROW;
-    void rollback() MAYTHROW;
+template<typename R, typename... Args>
+struct SqliteFunctionTraits<R (*)(Args...)>
+{
+    using Result = R;
+    using Arguments = std::tuple<std::decay_t<Args>...>;
+};
 
-private:
-    Transaction(std::shared_ptr<SqliteDatabase> database) MAYTHROW;
+template<typename C, typename R, typename... Args>
+struct SqliteFunctionTraits<R (C::*)(Args...)> : SqliteFunctionTraits<R (*)(Args...)>
+{
+
+};
+
+template<typename C, typename R, typename... Args>
+struct SqliteFunctionTraits<R (C::*)(Args...) const> : SqliteFunctionTraits<R (*)(Args...)>
+{
 
-    std::shared_ptr<SqliteDatabase> database;
-    const int exception_count;
 };
 
 
@@ -148,21 +1485,428 @@ private:
 class SqliteDatabase : public std::enable_shared_from_this<SqliteDatabase>
 {
     friend class Query;
+    friend class Transaction;
+    friend class BulkInserter;
+    friend class ChangeCapture;
 
 public:
     SqliteDatabase(sqlite3 *db) noexcept;
     ~SqliteDatabase();
+    SqliteDatabase(const SqliteDatabase &) = delete;
+    SqliteDatabase &operator=(const SqliteDatabase &) = delete;
 
     static std::shared_ptr<SqliteDatabase> open(const std::string &filename) MAYTHROW;
+    static std::shared_ptr<SqliteDatabase> open(const std::string &filename, const OpenOptions &options) MAYTHROW;
     static std::shared_ptr<SqliteDatabase> open_read_only(const std::string &filename) MAYTHROW;
     static std::shared_ptr<SqliteDatabase> open_in_memory() MAYTHROW;
 
     void exec(const char *sql) MAYTHROW;
+    sqlite3 *get_handle() const noexcept;
     Query create_query();
     Transaction begin_transaction();
+    bool in_transaction() const noexcept;
+
+    // Replace the sqlite allocator. Has to be called before any connection is open
+    static void set_allocator(const sqlite3_mem_methods &methods) MAYTHROW;
+    // Size-class pool allocator with per-thread free lists
+    static void use_pool_allocator() MAYTHROW;
+    BulkInserter create_bulk_inserter(const std::string &table, const std::vector<std::string> &columns,
+                                      size_t batch_rows = 500, size_t commit_rows = 100000) MAYTHROW;
+    // Inserts into the columns named after the SQLITE_MAP fields of T
+    template<typename T>
+    BulkInserter create_bulk_inserter(const std::string &table, size_t batch_rows = 500, size_t commit_rows = 100000) MAYTHROW
+    {
+        return create_bulk_inserter(table, sqlite_mapping_columns(SqliteMapping<T>::names()), batch_rows, commit_rows);
+    }
+
+    // Online backup. Copies pages_per_step pages at a time and sleeps for throttle between steps,
+    // so the source is locked only for short periods. progress is called as progress(remaining, page_count).
+    // Fails with SQLITE_BUSY or SQLITE_LOCKED if the source stays locked for the busy strategy deadline
+    using BackupProgress = std::function<void(int remaining, int page_count)>;
+    void backup_to(SqliteDatabase &target, int pages_per_step = 1024,
+                   std::chrono::milliseconds throttle = std::chrono::milliseconds(0),
+                   const BackupProgress &progress = BackupProgress(), const char *schema = "main") MAYTHROW;
+    void backup_to(const std::string &filename, int pages_per_step = 1024,
+                   std::chrono::milliseconds throttle = std::chrono::milliseconds(0),
+                   const BackupProgress &progress = BackupProgress(), const char *schema = "main") MAYTHROW;
+    // Runs the backup on a background thread with its own connection to the source file.
+    // Requires sqlite built with SQLITE_DATABASE_THREADSAFE=ON
+    static std::future<void> backup_in_background(const std::string &source, const std::string &target, int pages_per_step = 1024,
+                                                  std::chrono::milliseconds throttle = std::chrono::milliseconds(10),
+                                                  BackupProgress progress = BackupProgress()) MAYTHROW;
+
+    // Whole database image. Mostly useful for moving in-memory databases
+    std::vector<uint8_t> serialize(const char *schema = "main") const MAYTHROW;
+    void deserialize(const void *data, size_t size, bool read_only = false, const char *schema = "main") MAYTHROW;
+
+    // Prepared statement cache. Statements are looked up by SQL text on Query::prepare()
+    // and returned to the cache on Query reset/destruction. Capacity 0 disables caching
+    void set_statement_cache_capacity(size_t capacity) noexcept;
+    size_t get_statement_cache_capacity() const noexcept;
+    size_t get_statement_cache_size() const noexcept;
+    uint64_t get_statement_cache_hits() const noexcept;
+    uint64_t get_statement_cache_misses() const noexcept;
+
+    // Read-through cache for Query::fetch_cached(), keyed by the sql text with the bound values.
+    // Tables read by a statement are collected by the authorizer. Writes of this connection drop the entries
+    // reading the written tables. Commits of other connections, schema changes and changes the update hook
+    // doesn't see, e.g. WITHOUT ROWID tables, drop everything. Least recently used entries are evicted over max_bytes
+    void enable_result_cache(size_t max_bytes = 16 << 20) MAYTHROW;
+    void disable_result_cache() noexcept;
+    void clear_result_cache() noexcept;
+    ResultCacheStats get_result_cache_stats() const noexcept;
+
+    // Installs a busy handler with exponential backoff. Replaces a busy timeout set before
+    void set_busy_strategy(const BusyStrategy &strategy) noexcept;
+    // Locked databases fail immediately with SQLITE_BUSY
+    void clear_busy_strategy() noexcept;
+    const LockWaitStats &get_lock_wait_stats() const noexcept;
+    void reset_lock_wait_stats() noexcept;
+
+    // Opt-in instrumentation. Queries prepared while profiling is enabled record prepare and step
+    // latencies, returned rows and statement status counters. When disabled the only cost is a null check
+    void enable_profiling();
+    void disable_profiling() noexcept;
+    bool is_profiling() const noexcept;
+    DatabaseProfile get_profile() const;
+    void reset_profile() noexcept;
+
+    // Reports statements whose run takes longer than the threshold or makes a full table scan,
+    // with the bound values and the query plan. Every sql text is reported once.
+    // Applies to queries prepared after the call
+    void enable_slow_query_log(SlowQueryOptions options = SlowQueryOptions());
+    void disable_slow_query_log() noexcept;
+
+    // Registers fn as an SQL function. Arguments and the result are converted according to the signature:
+    //     database->register_function("ends_with", [](std::string_view str, std::string_view suffix) {...});
+    // Deterministic functions can be used in indexes and partial index conditions, and are factored out of loops.
+    // An exception thrown by fn fails the statement with its message
+    template<typename F>
+    void register_function(const std::string &name, F &&fn, bool deterministic = true) MAYTHROW
+    {
+        using Traits = SqliteFunctionTraits<std::decay_t<F>>;
+        using Function = ScalarFunction<std::decay_t<F>, typename Traits::Result, typename Traits::Arguments>;
+        create_function(name, std::tuple_size_v<typename Traits::Arguments>, deterministic,
+                        std::make_unique<Function>(std::forward<F>(fn)), false);
+    }
+
+    // Registers an aggregate with a State per group:
+    //     database->register_aggregate<Stats>("mean", [](Stats &state, double value) {...},
+    //                                                 [](const Stats &state) { return state.sum / state.count; });
+    // step is called as step(State &, args...) for every row, final(State &) returns the result.
+    // State is value-initialized for every group, final gets an empty state for an empty group
+    template<typename State, typename Step, typename Final>
+    void register_aggregate(const std::string &name, Step &&step, Final &&final, bool deterministic = true) MAYTHROW
+    {
+        using Arguments = typename SqliteFunctionTraits<std::decay_t<Step>>::Arguments;
+        using Function = AggregateFunction<State, std::decay_t<Step>, std::decay_t<Final>, Arguments>;
+        create_function(name, std::tuple_size_v<Arguments> - 1, deterministic,
+                        std::make_unique<Function>(std::forward<Step>(step), std::forward<Final>(final)), true);
+    }
+
+    // Exposes the fields of a struct registered with SQLITE_MAP as an eponymous read-only virtual table:
+    //     database->register_vtab("memory_users", users, "id");
+    //     SELECT * FROM memory_users JOIN orders ON orders.user_id = memory_users.id
+    // The rows aren't copied: the vector has to stay alive and unchanged while the connection is open.
+    // If the rows are sorted by sorted_key ascending, equality and range constraints on it are resolved by binary search.
+    // Constraints with another collation than BINARY or an argument of another storage class are checked row by row
+    template<typename T>
+    void register_vtab(const std::string &name, const std::vector<T> &rows, const char *sorted_key = nullptr) MAYTHROW
+    {
+        auto source = std::make_unique<ContainerSource<T>>(rows);
+        const auto columns = sqlite_mapping_columns(SqliteMapping<T>::names());
+        source->schema = "CREATE TABLE x(";
+        for (size_t idx = 0; idx < columns.size(); ++idx) {
+            if (idx) {
+                source->schema += ", ";
+            }
+            source->schema += '"' + columns[idx] + "\" " + ContainerSource<T>::column_type(idx);
+            if (sorted_key && columns[idx] == sorted_key && ContainerSource<T>::is_key_type(idx)) {
+                source->key_column = static_cast<int>(idx);
+                source->text_key = std::string_view(ContainerSource<T>::column_type(idx)) == "TEXT";
+            }
+        }
+        source->schema += ')';
+        create_module(name, std::move(source), sorted_key != nullptr);
+    }
 
 private:
+    template<typename T>
+    class ContainerSource : public VirtualTableSource
+    {
+        static constexpr auto fields = SqliteMapping<T>::fields();
+        static constexpr size_t field_count = std::tuple_size_v<decltype(fields)>;
+        template<size_t I>
+        using Field = std::decay_t<decltype(std::declval<const T &>().*std::get<I>(fields))>;
+
+    public:
+        ContainerSource(const std::vector<T> &rows) noexcept :
+            rows(rows)
+        {
+
+        }
+
+        size_t size() const noexcept override
+        {
+            return rows.size();
+        }
+
+        void column(size_t row, int idx, FunctionContext &context) const override
+        {
+            column(rows[row], static_cast<size_t>(idx), context, std::make_index_sequence<field_count>());
+        }
+
+        size_t partition_point(const FunctionContext &arguments, int idx, bool inclusive) const override
+        {
+            return partition_point(arguments, idx, inclusive, std::make_index_sequence<field_count>());
+        }
+
+        static const char *column_type(size_t idx) noexcept
+        {
+            return column_type(idx, std::make_index_sequence<field_count>());
+        }
+
+        static bool is_key_type(size_t idx) noexcept
+        {
+            return is_key_type(idx, std::make_index_sequence<field_count>());
+        }
+
+    private:
+        template<typename F>
+        static constexpr const char *type_name() noexcept
+        {
+            if constexpr (is_sqlite_optional_v<F>) {
+                return type_name<typename F::value_type>();
+            }
+            else if constexpr (std::is_convertible_v<const F &, std::string_view>) {
+                return "TEXT";
+            }
+            else if constexpr (std::is_floating_point_v<F>) {
+                return "REAL";
+            }
+            else if constexpr (std::is_integral_v<F>) {
+                return "INTEGER";
+            }
+            else {
+                return "BLOB";
+            }
+        }
+
+        template<typename F>
+        static constexpr bool key_type() noexcept
+        {
+            return std::is_arithmetic_v<F> || std::is_convertible_v<const F &, std::string_view>;
+        }
+
+        template<size_t... I>
+        static const char *column_type(size_t idx, std::index_sequence<I...>) noexcept
+        {
+            const char *result = "";
+            ((I == idx ? (result = type_name<Field<I>>(), true) : false) || ...);
+            return result;
+        }
+
+        template<size_t... I>
+        static bool is_key_type(size_t idx, std::index_sequence<I...>) noexcept
+        {
+            return ((I == idx && key_type<Field<I>>()) || ...);
+        }
+
+        template<size_t... I>
+        static void column(const T &row, size_t idx, FunctionContext &context, std::index_sequence<I...>)
+        {
+            ((I == idx ? (context.set_result(row.*std::get<I>(fields)), true) : false) || ...);
+        }
+
+        template<size_t I>
+        size_t partition_point(const FunctionContext &arguments, int idx, bool inclusive) const
+        {
+            using Key = Field<I>;
+            if constexpr (std::is_integral_v<Key>) {
+                // A fractional bound is compared as double, so id < 5.5 still includes 5
+                const auto integer = arguments.get_int64(idx);
+                const auto real = arguments.get_double(idx);
+                if (static_cast<double>(integer) != real) {
+                    return partition_point<I>(real, inclusive);
+                }
+                return partition_point<I>(integer, inclusive);
+            }
+            else if constexpr (key_type<Key>()) {
+                using Value = std::conditional_t<std::is_arithmetic_v<Key>, Key, std::string_view>;
+                return partition_point<I>(arguments.get<Value>(idx), inclusive);
+            }
+            else {
+                return 0;
+            }
+        }
+
+        template<size_t I, typename Value>
+        size_t partition_point(const Value &value, bool inclusive) const
+        {
+            auto it = std::partition_point(rows.begin(), rows.end(), [&value, inclusive](const T &row) {
+                const Value key = row.*std::get<I>(fields);
+                return inclusive ? !(value < key) : key < value;
+            });
+            return static_cast<size_t>(it - rows.begin());
+        }
+
+        template<size_t... I>
+        size_t partition_point(const FunctionContext &arguments, int idx, bool inclusive, std::index_sequence<I...>) const
+        {
+            size_t result = 0;
+            ((I == static_cast<size_t>(key_column) ? (result = partition_point<I>(arguments, idx, inclusive), true) : false) || ...);
+            return result;
+        }
+
+        const std::vector<T> &rows;
+    };
+
+    // Throws if the key is requested but the source has no key column
+    void create_module(const std::string &name, std::unique_ptr<VirtualTableSource> source, bool sorted) MAYTHROW;
+
+    template<typename F, typename R, typename Arguments>
+    class ScalarFunction;
+
+    template<typename F, typename R, typename... Args>
+    class ScalarFunction<F, R, std::tuple<Args...>> : public UserFunction
+    {
+    public:
+        ScalarFunction(F &&fn) :
+            fn(std::move(fn))
+        {
+
+        }
+
+        ScalarFunction(const F &fn) :
+            fn(fn)
+        {
+
+        }
+
+        void call(FunctionContext &context) override
+        {
+            call(context, std::index_sequence_for<Args...>());
+        }
+
+    private:
+        template<size_t... I>
+        inline void call(FunctionContext &context, std::index_sequence<I...>)
+        {
+            if constexpr (std::is_void_v<R>) {
+                fn(context.get<Args>(I)...);
+                context.result_null();
+            }
+            else {
+                context.set_result(fn(context.get<Args>(I)...));
+            }
+        }
+
+        F fn;
+    };
+
+    template<typename State, typename Step, typename Final, typename Arguments>
+    class AggregateFunction;
+
+    template<typename State, typename Step, typename Final, typename StateArg, typename... Args>
+    class AggregateFunction<State, Step, Final, std::tuple<StateArg, Args...>> : public UserFunction
+    {
+        static_assert(std::is_same_v<StateArg, State>, "The first step argument has to be State &");
+
+    public:
+        template<typename S, typename F>
+        AggregateFunction(S &&step_fn, F &&final_fn) :
+            step_fn(std::forward<S>(step_fn)), final_fn(std::forward<F>(final_fn))
+        {
+
+        }
+
+        void step(FunctionContext &context) override
+        {
+            // sqlite frees the aggregate memory itself, so it holds a pointer to the state
+            auto slot = static_cast<State **>(context.get_aggregate_state(sizeof(State *)));
+            if (!slot) {
+                throw std::bad_alloc();
+            }
+            if (!*slot) {
+                *slot = new State();
+            }
+            step(**slot, context, std::index_sequence_for<Args...>());
+        }
+
+        void final(FunctionContext &context) override
+        {
+            auto slot = static_cast<State **>(context.peek_aggregate_state());
+            std::unique_ptr<State> state(slot ? *slot : nullptr);
+            if (!state) {
+                state = std::make_unique<State>();
+            }
+            context.set_result(final_fn(*state));
+        }
+
+    private:
+        template<size_t... I>
+        inline void step(State &state, FunctionContext &context, std::index_sequence<I...>)
+        {
+            step_fn(state, context.get<Args>(I)...);
+        }
+
+        Step step_fn;
+        Final final_fn;
+    };
+
+    void create_function(const std::string &name, size_t argc, bool deterministic,
+                         std::unique_ptr<UserFunction> function, bool aggregate) MAYTHROW;
+
+    static int busy_handler(void *database, int count) noexcept;
+    // Sleeps before the attempt-th retry. Returns false if the deadline counted from start is exceeded
+    bool busy_wait(int attempt, std::chrono::steady_clock::time_point start) noexcept;
+
+    // sql must be null-terminated
+    sqlite3_stmt *acquire_statement(std::string_view sql) MAYTHROW;
+    void release_statement(std::string_view sql, sqlite3_stmt *stmt) noexcept;
+    void shrink_statement_cache(size_t size) noexcept;
+
+    // Transaction control statements are kept prepared for the connection lifetime
+    void exec_control(sqlite3_stmt *&stmt, const char *sql) MAYTHROW;
+    void begin_transaction_level(Transaction &transaction) MAYTHROW;
+    void commit_transaction_level(const Transaction &transaction) MAYTHROW;
+    void rollback_transaction_level(const Transaction &transaction) MAYTHROW;
+    void finalize_control_statements() noexcept;
+
     sqlite3 *db = nullptr;
+
+    sqlite3_stmt *begin_stmt = nullptr;
+    sqlite3_stmt *commit_stmt = nullptr;
+    sqlite3_stmt *rollback_stmt = nullptr;
+    // SAVEPOINT, RELEASE and ROLLBACK TO statements for every nesting level
+    std::vector<std::array<sqlite3_stmt *, 3>> savepoint_stmts;
+    size_t transaction_depth = 0;
+
+    // Lowercase names of the functions registered by create_function() and whether all their overloads are deterministic
+    std::unordered_map<std::string, bool> registered_functions;
+    std::unique_ptr<ResultCache> result_cache;
+    // Flushed before the outermost Transaction begins and after it commits
+    ChangeCapture *change_capture = nullptr;
+
+    std::optional<BusyStrategy> busy_strategy;
+    std::chrono::steady_clock::time_point busy_start;
+    uint64_t busy_random = 0;
+    LockWaitStats lock_wait_stats;
+
+    // The profiler outlives disable_profiling(): queries keep pointers to its statement profiles
+    std::unique_ptr<QueryProfiler> profiler;
+    bool profiling = false;
+    // Kept after disable_slow_query_log() for the same reason
+    std::unique_ptr<SlowQueryLog> slow_query_log;
+    bool slow_query_logging = false;
+
+    // most recently used statements are at the front
+    using StatementCacheList = std::list<std::pair<std::string, sqlite3_stmt *>>;
+    StatementCacheList stmt_cache;
+    std::unordered_map<std::string_view, StatementCacheList::iterator> stmt_cache_index;
+    size_t stmt_cache_capacity = 32;
+    uint64_t stmt_cache_hits = 0;
+    uint64_t stmt_cache_misses = 0;
 };
 
 
@@ -172,10 +1916,122 @@ class DatabaseException : public std::exception
 public:
     DatabaseException(sqlite3 *db);
     DatabaseException(const char *msg);
+    DatabaseException(const DatabaseStatus &status);
     const char *what() const noexcept override;
+    // Extended result code. SQLITE_ERROR for errors raised by the wrapper itself
+    int get_code() const noexcept;
 
 private:
     std::string message;
+    int code;
+};
+
+
+
+// Counts the positional '?' parameters of an sql statement, skipping quoted strings and comments
+constexpr size_t count_sql_parameters(const char *sql)
+{
+    size_t count = 0;
+    while (*sql) {
+        const char c = *sql++;
+        if (c == '\'' || c == '"' || c == '`') {
+            while (*sql && *sql++ != c);
+        }
+        else if (c == '[') {
+            while (*sql && *sql++ != ']');
+        }
+        else if (c == '-' && *sql == '-') {
+            while (*sql && *sql != '\n') {
+                ++sql;
+            }
+        }
+        else if (c == '/' && *sql == '*') {
+            ++sql;
+            while (*sql && !(sql[0] == '*' && sql[1] == '/')) {
+                ++sql;
+            }
+            if (*sql) {
+                sql += 2;
+            }
+        }
+        else if (c == '?') {
+            ++count;
+        }
+    }
+    return count;
+}
+
+
+
+// Statically typed statement.
+// Sql must be a constexpr char array with static storage duration:
+//     static constexpr char sql[] = "SELECT id, name FROM table WHERE id = ?";
+//     TypedQuery<sql, std::tuple<int64_t>, int64_t, std::string> query(database);
+//     query.bind(3);
+//     while (query.step()) {
+//         auto [id, name] = query.get();
+//     }
+// Parameter count is checked at compile time, column count is checked once after prepare,
+// so fetching a row is a straight sequence of column reads without bounds checks
+template<const char *Sql, typename Params, typename... Cols>
+class TypedQuery;
+
+template<const char *Sql, typename... Params, typename... Cols>
+class TypedQuery<Sql, std::tuple<Params...>, Cols...>
+{
+    static_assert(count_sql_parameters(Sql) == sizeof...(Params), "Parameter count doesn't match the sql statement");
+
+public:
+    using Row = std::tuple<Cols...>;
+
+    TypedQuery(const std::shared_ptr<SqliteDatabase> &database) MAYTHROW :
+        query(database->create_query())
+    {
+        query << Sql;
+        query.prepare();
+        if (query.col_count != static_cast<int>(sizeof...(Cols))) {
+            throw DatabaseException("Column count doesn't match the sql statement");
+        }
+    }
+
+    // Resets the statement and binds all parameters at once
+    TypedQuery &bind(const Params &...params) MAYTHROW
+    {
+        query.clear_bindings();
+        (query.bind(params), ...);
+        return *this;
+    }
+
+    inline bool step() MAYTHROW
+    {
+        return query.step();
+    }
+
+    inline Row get() const
+    {
+        return get<Row>();
+    }
+
+    // Decodes the current row into a tuple or an aggregate with fields ordered as Cols
+    template<typename T>
+    T get() const
+    {
+        return fetch<T>(std::index_sequence_for<Cols...>());
+    }
+
+    inline Query &get_query() noexcept
+    {
+        return query;
+    }
+
+private:
+    template<typename T, size_t... I>
+    inline T fetch(std::index_sequence<I...>) const
+    {
+        return T{query.column_value<Cols>(I)...};
+    }
+
+    Query query;
 };
 
 
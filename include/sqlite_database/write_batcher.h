@@ -0,0 +1,101 @@
+/*
+Sqlite Database wrapper for Modern C++
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+SPDX-License-Identifier: MIT
+
+Copyright (c) 2020 Ivan Volnov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef WRITE_BATCHER_H
+#define WRITE_BATCHER_H
+
+#include <sqlite_database/database_task.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+
+
+// Group commit for high-rate small writes from many threads.
+// Write closures are collected and executed in one transaction on a worker thread that owns the connection,
+// either max_delay after the first pending write or as soon as max_batch writes are pending.
+// Each write runs inside its own savepoint, so a failing write is rolled back alone.
+// The futures are completed after the shared commit, so a completed future means the write is committed.
+// Whether it survives a power loss depends on the synchronous setting: WAL with synchronous=NORMAL may lose the last commits.
+// The connection must not be used directly while the WriteBatcher is alive.
+// Requires sqlite built with SQLITE_DATABASE_THREADSAFE=ON
+class WriteBatcher
+{
+public:
+    WriteBatcher(std::shared_ptr<SqliteDatabase> database,
+                 std::chrono::milliseconds max_delay = std::chrono::milliseconds(10), size_t max_batch = 1000) MAYTHROW;
+    // Commits the pending writes
+    ~WriteBatcher();
+    WriteBatcher(const WriteBatcher &) = delete;
+    WriteBatcher &operator=(const WriteBatcher &) = delete;
+
+    static std::unique_ptr<WriteBatcher> open(const std::string &filename, const OpenOptions &options = OpenOptions(),
+                                              std::chrono::milliseconds max_delay = std::chrono::milliseconds(10),
+                                              size_t max_batch = 1000) MAYTHROW;
+
+    // fn is called as fn(SqliteDatabase &) on the worker thread
+    template<typename F>
+    auto submit(F &&fn)
+    {
+        using R = std::invoke_result_t<std::decay_t<F> &, SqliteDatabase &>;
+        auto task = new DatabaseFunctionTask<F, R>(std::forward<F>(fn), true);
+        auto future = task->promise.get_future();
+        push(task);
+        return future;
+    }
+
+    // Commits the pending writes without waiting for max_delay
+    void flush() noexcept;
+
+    uint64_t get_commit_count() const noexcept;
+    uint64_t get_write_count() const noexcept;
+
+private:
+    void push(DatabaseTask *task) noexcept;
+    void run() noexcept;
+    void execute(DatabaseTask *tasks) noexcept;
+
+    std::shared_ptr<SqliteDatabase> database;
+    const std::chrono::milliseconds max_delay;
+    const size_t max_batch;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    DatabaseTask *head = nullptr;
+    DatabaseTask *tail = nullptr;
+    size_t pending = 0;
+    std::chrono::steady_clock::time_point deadline;
+    bool flushing = false;
+    bool stopping = false;
+    std::atomic<uint64_t> commit_count = 0;
+    std::atomic<uint64_t> write_count = 0;
+    std::thread worker;
+};
+
+
+#endif // WRITE_BATCHER_H
@@ -0,0 +1,117 @@
+/*
+Sqlite Database wrapper for Modern C++
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+SPDX-License-Identifier: MIT
+
+Copyright (c) 2020 Ivan Volnov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <sqlite_database/async_database.h>
+#include <libs/sqlite3/sqlite3.h>
+
+
+
+AsyncDatabase::AsyncDatabase(std::shared_ptr<SqliteDatabase> database) MAYTHROW :
+    database(std::move(database))
+{
+    if (!sqlite3_threadsafe()) {
+        throw DatabaseException("AsyncDatabase requires sqlite built with SQLITE_DATABASE_THREADSAFE=ON");
+    }
+    worker = std::thread(&AsyncDatabase::run, this);
+}
+
+AsyncDatabase::~AsyncDatabase()
+{
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    wakeup.notify_one();
+    worker.join();
+}
+
+std::unique_ptr<AsyncDatabase> AsyncDatabase::open(const std::string &filename, const OpenOptions &options) MAYTHROW
+{
+    return std::make_unique<AsyncDatabase>(SqliteDatabase::open(filename, options));
+}
+
+void AsyncDatabase::push(DatabaseTask *task) noexcept
+{
+    // Treiber stack push. The worker takes the whole stack at once and restores the submission order
+    auto old_head = head.load(std::memory_order_relaxed);
+    do {
+        task->next = old_head;
+    } while (!head.compare_exchange_weak(old_head, task, std::memory_order_release, std::memory_order_relaxed));
+    if (!old_head) {
+        // The queue was empty, the worker may be sleeping. Locking prevents a lost wakeup
+        std::lock_guard lock(mutex);
+        wakeup.notify_one();
+    }
+}
+
+DatabaseTask *AsyncDatabase::pop_all() noexcept
+{
+    DatabaseTask *reversed = head.exchange(nullptr, std::memory_order_acquire);
+    DatabaseTask *tasks = nullptr;
+    while (reversed) {
+        auto next = reversed->next;
+        reversed->next = tasks;
+        tasks = reversed;
+        reversed = next;
+    }
+    return tasks;
+}
+
+void AsyncDatabase::run() noexcept
+{
+    while (true) {
+        if (auto tasks = pop_all()) {
+            execute(tasks);
+            continue;
+        }
+        std::unique_lock lock(mutex);
+        wakeup.wait(lock, [this] { return stopping || head.load(std::memory_order_acquire); });
+        if (stopping && !head.load(std::memory_order_acquire)) {
+            return;
+        }
+    }
+}
+
+void AsyncDatabase::execute(DatabaseTask *tasks) noexcept
+{
+    while (tasks) {
+        if (!tasks->write) {
+            auto task = tasks;
+            tasks = tasks->next;
+            task->run(*database);
+            task->complete(nullptr);
+            delete task;
+            continue;
+        }
+        // Run consecutive writes in one transaction
+        auto first = tasks;
+        while (tasks && tasks->write) {
+            tasks = tasks->next;
+        }
+        DatabaseTask::run_write_batch(*database, first, tasks, [](size_t) {});
+    }
+}
@@ -0,0 +1,214 @@
+/*
+Sqlite Database wrapper for Modern C++
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+SPDX-License-Identifier: MIT
+
+Copyright (c) 2020 Ivan Volnov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <sqlite_database/blob_stream.h>
+#include <libs/sqlite3/sqlite3.h>
+#include <algorithm>
+#include <limits>
+
+
+
+BlobStream::BlobStream(std::shared_ptr<SqliteDatabase> database, const char *table, const char *column, int64_t rowid,
+                       bool writable, const char *schema) MAYTHROW :
+    database(std::move(database))
+{
+    auto db = this->database->get_handle();
+    if (sqlite3_blob_open(db, schema, table, column, rowid, writable, &blob) != SQLITE_OK) {
+        DatabaseException e(db);
+        sqlite3_blob_close(blob);
+        throw e;
+    }
+    blob_size = sqlite3_blob_bytes(blob);
+}
+
+BlobStream::~BlobStream()
+{
+    sqlite3_blob_close(blob);
+}
+
+size_t BlobStream::size() const noexcept
+{
+    return blob_size;
+}
+
+size_t BlobStream::read(void *buffer, size_t size, size_t offset) MAYTHROW
+{
+    if (offset >= blob_size) {
+        return 0;
+    }
+    size = std::min(size, blob_size - offset);
+    if (sqlite3_blob_read(blob, buffer, size, offset) != SQLITE_OK) {
+        throw DatabaseException(database->get_handle());
+    }
+    return size;
+}
+
+void BlobStream::write(const void *data, size_t size, size_t offset) MAYTHROW
+{
+    if (offset > blob_size || size > blob_size - offset) {
+        throw DatabaseException("Blob write is out of range");
+    }
+    if (sqlite3_blob_write(blob, data, size, offset) != SQLITE_OK) {
+        throw DatabaseException(database->get_handle());
+    }
+}
+
+void BlobStream::reopen(int64_t rowid) MAYTHROW
+{
+    if (sqlite3_blob_reopen(blob, rowid) != SQLITE_OK) {
+        blob_size = 0;
+        throw DatabaseException(database->get_handle());
+    }
+    blob_size = sqlite3_blob_bytes(blob);
+}
+
+
+
+BlobStreamBuffer::BlobStreamBuffer(BlobStream &blob, size_t buffer_size) :
+    blob(blob), buffer(std::max<size_t>(buffer_size, 1))
+{
+
+}
+
+BlobStreamBuffer::~BlobStreamBuffer()
+{
+    flush();
+}
+
+BlobStreamBuffer::int_type BlobStreamBuffer::underflow()
+{
+    if (!flush()) {
+        return traits_type::eof();
+    }
+    offset = position();
+    size_t count;
+    try {
+        count = blob.read(buffer.data(), buffer.size(), offset);
+    } catch (const std::exception &) {
+        count = 0;
+    }
+    setp(nullptr, nullptr);
+    setg(buffer.data(), buffer.data(), buffer.data() + count);
+    return count ? traits_type::to_int_type(buffer[0]) : traits_type::eof();
+}
+
+BlobStreamBuffer::int_type BlobStreamBuffer::overflow(int_type ch)
+{
+    if (!flush()) {
+        return traits_type::eof();
+    }
+    offset = position();
+    setg(nullptr, nullptr, nullptr);
+    // the put area never goes past the end of the blob
+    const auto size = std::min(buffer.size(), blob.size() - std::min(offset, blob.size()));
+    setp(buffer.data(), buffer.data() + size);
+    if (traits_type::eq_int_type(ch, traits_type::eof())) {
+        return traits_type::not_eof(ch);
+    }
+    if (!size) {
+        return traits_type::eof();
+    }
+    *pptr() = traits_type::to_char_type(ch);
+    pbump(1);
+    return ch;
+}
+
+int BlobStreamBuffer::sync()
+{
+    return flush() ? 0 : -1;
+}
+
+BlobStreamBuffer::pos_type BlobStreamBuffer::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+{
+    off_type base;
+    switch (dir) {
+    case std::ios_base::beg:
+        base = 0;
+        break;
+    case std::ios_base::cur:
+        base = position();
+        break;
+    default:
+        base = blob.size();
+        break;
+    }
+    return seekpos(base + off, which);
+}
+
+BlobStreamBuffer::pos_type BlobStreamBuffer::seekpos(pos_type pos, std::ios_base::openmode)
+{
+    if (pos < 0 || static_cast<size_t>(pos) > blob.size() || !flush()) {
+        return pos_type(off_type(-1));
+    }
+    offset = pos;
+    setg(nullptr, nullptr, nullptr);
+    setp(nullptr, nullptr);
+    return pos;
+}
+
+bool BlobStreamBuffer::flush() noexcept
+{
+    if (pbase() == pptr()) {
+        return true;
+    }
+    const size_t count = pptr() - pbase();
+    try {
+        blob.write(pbase(), count, offset);
+    } catch (const std::exception &) {
+        return false;
+    }
+    offset += count;
+    setp(nullptr, nullptr);
+    return true;
+}
+
+size_t BlobStreamBuffer::position() const noexcept
+{
+    if (gptr()) {
+        return offset + (gptr() - eback());
+    }
+    return offset + (pptr() - pbase());
+}
+
+
+
+BlobInputStream::BlobInputStream(BlobStream &blob, size_t buffer_size) :
+    std::istream(nullptr), buffer(blob, buffer_size)
+{
+    rdbuf(&buffer);
+}
+
+BlobOutputStream::BlobOutputStream(BlobStream &blob, size_t buffer_size) :
+    std::ostream(nullptr), buffer(blob, buffer_size)
+{
+    rdbuf(&buffer);
+}
+
+BlobOutputStream::~BlobOutputStream()
+{
+    buffer.pubsync();
+}
@@ -0,0 +1,247 @@
+/*
+Sqlite Database wrapper for Modern C++
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+SPDX-License-Identifier: MIT
+
+Copyright (c) 2020 Ivan Volnov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <sqlite_database/change_capture.h>
+#include <libs/sqlite3/sqlite3.h>
+
+
+
+static void write_varint(std::ostream &stream, uint64_t value)
+{
+    char buffer[10];
+    size_t size = 0;
+    do {
+        buffer[size] = static_cast<char>(value & 0x7f);
+        value >>= 7;
+        if (value) {
+            buffer[size] |= 0x80;
+        }
+        ++size;
+    } while (value);
+    stream.write(buffer, size);
+}
+
+// Returns false at the end of the stream before the first byte
+static bool read_varint(std::istream &stream, uint64_t &value) MAYTHROW
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        const auto c = stream.get();
+        if (c == std::istream::traits_type::eof()) {
+            if (shift == 0) {
+                return false;
+            }
+            throw DatabaseException("Truncated changeset frame");
+        }
+        value |= static_cast<uint64_t>(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+    }
+    throw DatabaseException("Invalid changeset frame");
+}
+
+namespace {
+
+struct ConflictContext
+{
+    ChangeConflictPolicy policy = ChangeConflictPolicy::Abort;
+    int conflict = 0;
+    std::string table;
+};
+
+}
+
+static int on_conflict(void *ctx, int conflict, sqlite3_changeset_iter *iter) noexcept
+{
+    auto context = static_cast<ConflictContext *>(ctx);
+    switch (context->policy) {
+    case ChangeConflictPolicy::Replace:
+        // REPLACE is only allowed for the conflicts with an existing row
+        if (conflict == SQLITE_CHANGESET_DATA || conflict == SQLITE_CHANGESET_CONFLICT) {
+            return SQLITE_CHANGESET_REPLACE;
+        }
+        return SQLITE_CHANGESET_OMIT;
+    case ChangeConflictPolicy::Omit:
+        return SQLITE_CHANGESET_OMIT;
+    default:
+        if (!context->conflict) {
+            context->conflict = conflict;
+            const char *table = nullptr;
+            int columns = 0, op = 0;
+            if (sqlite3changeset_op(iter, &table, &columns, &op, nullptr) == SQLITE_OK && table) {
+                context->table = table;
+            }
+        }
+        return SQLITE_CHANGESET_ABORT;
+    }
+}
+
+static const char *conflict_name(int conflict) noexcept
+{
+    switch (conflict) {
+    case SQLITE_CHANGESET_DATA:
+        return "the row has different values";
+    case SQLITE_CHANGESET_NOTFOUND:
+        return "the row doesn't exist";
+    case SQLITE_CHANGESET_CONFLICT:
+        return "the row already exists";
+    case SQLITE_CHANGESET_CONSTRAINT:
+        return "constraint violation";
+    case SQLITE_CHANGESET_FOREIGN_KEY:
+        return "foreign key violation";
+    default:
+        return "unknown conflict";
+    }
+}
+
+
+
+ChangeCapture::ChangeCapture(std::shared_ptr<SqliteDatabase> database, Sink sink, const std::vector<std::string> &tables,
+                             uint64_t last_sequence, const char *schema) MAYTHROW :
+    database(std::move(database)), sink(std::move(sink)), tables(tables), schema(schema), sequence(last_sequence)
+{
+    if (this->database->change_capture) {
+        throw DatabaseException("Changes of the connection are already captured");
+    }
+    session = create_session();
+    this->database->change_capture = this;
+}
+
+ChangeCapture::~ChangeCapture()
+{
+    database->change_capture = nullptr;
+    sqlite3session_delete(session);
+}
+
+sqlite3_session *ChangeCapture::create_session() const MAYTHROW
+{
+    const auto db = database->get_handle();
+    sqlite3_session *result = nullptr;
+    int rc = sqlite3session_create(db, schema.c_str(), &result);
+    if (rc != SQLITE_OK) {
+        throw DatabaseException(DatabaseStatus(rc, db));
+    }
+    if (tables.empty()) {
+        rc = sqlite3session_attach(result, nullptr);
+    }
+    else {
+        for (const auto &table : tables) {
+            if ((rc = sqlite3session_attach(result, table.c_str())) != SQLITE_OK) {
+                break;
+            }
+        }
+    }
+    if (rc != SQLITE_OK) {
+        sqlite3session_delete(result);
+        throw DatabaseException(DatabaseStatus(rc, db));
+    }
+    return result;
+}
+
+void ChangeCapture::flush() MAYTHROW
+{
+    if (sqlite3session_isempty(session)) {
+        return;
+    }
+    int size = 0;
+    void *data = nullptr;
+    const int rc = sqlite3session_changeset(session, &size, &data);
+    if (rc != SQLITE_OK) {
+        throw DatabaseException(DatabaseStatus(rc, database->get_handle()));
+    }
+    // changes that were rolled back leave the session non-empty with an empty changeset
+    if (size > 0) {
+        try {
+            sink(sequence + 1, BlobView(data, size));
+        } catch (...) {
+            sqlite3_free(data);
+            throw;
+        }
+        ++sequence;
+    }
+    sqlite3_free(data);
+    // A session can't be cleared, the next changeset starts with a new one
+    auto next = create_session();
+    sqlite3session_delete(session);
+    session = next;
+}
+
+uint64_t ChangeCapture::get_last_sequence() const noexcept
+{
+    return sequence;
+}
+
+ChangeCapture::Sink ChangeCapture::stream_to(std::ostream &stream)
+{
+    return [&stream](uint64_t sequence, BlobView changeset) {
+        write_varint(stream, sequence);
+        write_varint(stream, changeset.size());
+        stream.write(reinterpret_cast<const char *>(changeset.data()), changeset.size());
+        if (!stream) {
+            throw DatabaseException("Can't write the changeset to the stream");
+        }
+    };
+}
+
+void ChangeCapture::apply(SqliteDatabase &replica, BlobView changeset, ChangeConflictPolicy policy) MAYTHROW
+{
+    const auto db = replica.get_handle();
+    ConflictContext context;
+    context.policy = policy;
+    const int rc = sqlite3changeset_apply(db, static_cast<int>(changeset.size()), const_cast<uint8_t *>(changeset.data()),
+                                          nullptr, &on_conflict, &context);
+    if (context.conflict) {
+        const auto message = "Changeset conflict on table " + context.table + ": " + conflict_name(context.conflict);
+        throw DatabaseException(message.c_str());
+    }
+    if (rc != SQLITE_OK) {
+        throw DatabaseException(DatabaseStatus(rc, db));
+    }
+}
+
+uint64_t ChangeCapture::apply_stream(SqliteDatabase &replica, std::istream &stream, uint64_t after,
+                                     ChangeConflictPolicy policy) MAYTHROW
+{
+    std::vector<uint8_t> changeset;
+    uint64_t sequence, size;
+    while (read_varint(stream, sequence)) {
+        if (!read_varint(stream, size)) {
+            throw DatabaseException("Truncated changeset frame");
+        }
+        changeset.resize(size);
+        if (!stream.read(reinterpret_cast<char *>(changeset.data()), size)) {
+            throw DatabaseException("Truncated changeset frame");
+        }
+        if (sequence <= after) {
+            continue;
+        }
+        apply(replica, BlobView(changeset.data(), changeset.size()), policy);
+        after = sequence;
+    }
+    return after;
+}
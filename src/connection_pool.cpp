@@ -0,0 +1,227 @@
+/*
+Sqlite Database wrapper for Modern C++
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+SPDX-License-Identifier: MIT
+
+Copyright (c) 2020 Ivan Volnov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <sqlite_database/connection_pool.h>
+#include <libs/sqlite3/sqlite3.h>
+#include <algorithm>
+
+
+
+ConnectionPool::Lease::Lease(std::shared_ptr<ConnectionPool> pool, std::shared_ptr<SqliteDatabase> database, bool writer) noexcept :
+    pool(std::move(pool)), database(std::move(database)), writer(writer)
+{
+
+}
+
+ConnectionPool::Lease::~Lease()
+{
+    release();
+}
+
+ConnectionPool::Lease::Lease(Lease &&other) noexcept :
+    pool(std::move(other.pool)), database(std::move(other.database)), writer(other.writer)
+{
+
+}
+
+ConnectionPool::Lease &ConnectionPool::Lease::operator=(Lease &&other) noexcept
+{
+    if (this != &other) {
+        release();
+        pool = std::move(other.pool);
+        database = std::move(other.database);
+        writer = other.writer;
+    }
+    return *this;
+}
+
+void ConnectionPool::Lease::release() noexcept
+{
+    if (pool) {
+        pool->release(std::move(database), writer);
+        pool.reset();
+    }
+}
+
+
+
+ConnectionPool::ConnectionPool(const std::string &filename, size_t readers, const OpenOptions &options) MAYTHROW :
+    filename(filename), reader_count(readers)
+{
+    if (!sqlite3_threadsafe()) {
+        throw DatabaseException("ConnectionPool requires sqlite built with SQLITE_DATABASE_THREADSAFE=ON");
+    }
+    // The writer has to switch the database into WAL mode before the readers are open
+    auto writer_options = options;
+    writer_options.read_only = false;
+    writer_options.journal_mode = "WAL";
+    writer = SqliteDatabase::open(filename, writer_options);
+
+    auto reader_options = options;
+    reader_options.read_only = true;
+    reader_options.page_size.reset();
+    reader_options.journal_mode.clear();
+    idle_readers.reserve(readers);
+    for (size_t i = 0; i < readers; ++i) {
+        idle_readers.push_back(SqliteDatabase::open(filename, reader_options));
+    }
+}
+
+std::shared_ptr<ConnectionPool> ConnectionPool::open(const std::string &filename, size_t readers, const OpenOptions &options) MAYTHROW
+{
+    return std::make_shared<ConnectionPool>(filename, readers, options);
+}
+
+ConnectionPool::Lease ConnectionPool::acquire_reader()
+{
+    std::unique_lock lock(mutex);
+    reader_released.wait(lock, [this] { return !idle_readers.empty(); });
+    auto database = std::move(idle_readers.back());
+    idle_readers.pop_back();
+    return Lease(shared_from_this(), std::move(database), false);
+}
+
+std::vector<ConnectionPool::Lease> ConnectionPool::acquire_readers(size_t n)
+{
+    std::vector<Lease> leases;
+    leases.reserve(n);
+    std::unique_lock lock(mutex);
+    // Taking them one by one could deadlock two callers holding a part each
+    reader_released.wait(lock, [this, n] { return idle_readers.size() >= n; });
+    for (size_t i = 0; i < n; ++i) {
+        leases.push_back(Lease(shared_from_this(), std::move(idle_readers.back()), false));
+        idle_readers.pop_back();
+    }
+    return leases;
+}
+
+ConnectionPool::Lease ConnectionPool::acquire_writer()
+{
+    std::unique_lock lock(mutex);
+    writer_released.wait(lock, [this] { return !writer_leased; });
+    writer_leased = true;
+    return Lease(shared_from_this(), writer, true);
+}
+
+size_t ConnectionPool::get_reader_count() const noexcept
+{
+    return reader_count;
+}
+
+const std::string &ConnectionPool::get_filename() const noexcept
+{
+    return filename;
+}
+
+void ConnectionPool::release(std::shared_ptr<SqliteDatabase> database, bool writer) noexcept
+{
+    {
+        std::lock_guard lock(mutex);
+        if (writer) {
+            writer_leased = false;
+        }
+        else {
+            // capacity is reserved for all readers, push_back can't throw
+            idle_readers.push_back(std::move(database));
+        }
+    }
+    if (writer) {
+        writer_released.notify_one();
+    }
+    else {
+        // acquire_readers() may wait for more than one
+        reader_released.notify_all();
+    }
+}
+
+
+
+ConnectionPool::ScanSnapshot::ScanSnapshot(ConnectionPool &pool, const std::string &sql_template,
+                                           const std::string &partition_key, size_t n) MAYTHROW
+{
+    const auto dot = partition_key.rfind('.');
+    if (dot == std::string::npos) {
+        throw DatabaseException("Partition key has to be in the table.column form");
+    }
+    const auto placeholder = sql_template.find("{partition}");
+    if (placeholder == std::string::npos) {
+        throw DatabaseException("Sql template has no {partition} placeholder");
+    }
+    sql = sql_template;
+    sql.replace(placeholder, 11, "(" + partition_key + " BETWEEN :partition_first AND :partition_last)");
+
+    n = std::clamp<size_t>(n, 1, std::max<size_t>(pool.get_reader_count(), 1));
+    leases = pool.acquire_readers(n);
+    auto &lease = leases.front();
+    transaction.reset(new Transaction(lease->begin_transaction()));
+    auto bounds = lease->create_query();
+    const auto column = partition_key.substr(dot + 1);
+    bounds << "SELECT min(" + column + "), max(" + column + ") FROM " + partition_key.substr(0, dot);
+    bounds.step();
+    if (sqlite3_snapshot_get(lease->get_handle(), "main", &snapshot) != SQLITE_OK) {
+        throw DatabaseException(lease->get_handle());
+    }
+    if (bounds.is_null()) {
+        // Empty table, the scan still runs once on an empty range
+        ranges.emplace_back(0, -1);
+        leases.erase(leases.begin() + 1, leases.end());
+        return;
+    }
+    const auto first = bounds.get_int64();
+    const auto last = bounds.get_int64();
+    if (n == 1) {
+        // The step of the full int64 range wouldn't fit in uint64
+        ranges.emplace_back(first, last);
+        return;
+    }
+
+    // Unsigned arithmetic doesn't overflow on the full int64 range
+    const uint64_t span = static_cast<uint64_t>(last) - static_cast<uint64_t>(first);
+    const uint64_t step = span / n + 1;
+    for (uint64_t offset = 0; ; offset += step) {
+        const auto range_first = static_cast<int64_t>(static_cast<uint64_t>(first) + offset);
+        if (span - offset < step) {
+            ranges.emplace_back(range_first, last);
+            break;
+        }
+        ranges.emplace_back(range_first, static_cast<int64_t>(static_cast<uint64_t>(range_first) + step - 1));
+    }
+    // Small key ranges split into fewer parts
+    leases.erase(leases.begin() + ranges.size(), leases.end());
+}
+
+ConnectionPool::ScanSnapshot::~ScanSnapshot()
+{
+    sqlite3_snapshot_free(snapshot);
+}
+
+void ConnectionPool::ScanSnapshot::open(SqliteDatabase &database) MAYTHROW
+{
+    if (sqlite3_snapshot_open(database.get_handle(), "main", snapshot) != SQLITE_OK) {
+        throw DatabaseException(database.get_handle());
+    }
+}
@@ -0,0 +1,202 @@
+/*
+Sqlite Database wrapper for Modern C++
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+SPDX-License-Identifier: MIT
+
+Copyright (c) 2020 Ivan Volnov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <src/pool_allocator.h>
+#include <cstdlib>
+#include <cstring>
+
+
+
+namespace {
+
+// Every block starts with a header keeping the usable size and the size class.
+// 16 bytes keep the payload aligned the same way malloc does
+struct alignas(16) Header
+{
+    size_t size;
+    size_t size_class;
+};
+
+constexpr size_t min_block_shift = 5; // 32 bytes
+constexpr size_t class_count = 9;     // up to 8 KiB
+constexpr size_t large_class = class_count;
+constexpr size_t max_cached_blocks = 512;
+
+constexpr size_t block_size(size_t size_class) noexcept
+{
+    return size_t(1) << (size_class + min_block_shift);
+}
+
+size_t size_class_of(size_t bytes) noexcept
+{
+    const auto total = bytes + sizeof(Header);
+    size_t size_class = 0;
+    while (size_class < class_count && block_size(size_class) < total) {
+        ++size_class;
+    }
+    return size_class;
+}
+
+struct FreeBlock
+{
+    FreeBlock *next;
+};
+
+// Blocks freed by a thread go to its own cache whichever thread has allocated them
+struct ThreadCache
+{
+    FreeBlock *lists[class_count] = {};
+    size_t counts[class_count] = {};
+
+    ~ThreadCache();
+};
+
+thread_local bool cache_destroyed = false;
+thread_local ThreadCache cache;
+
+ThreadCache::~ThreadCache()
+{
+    for (auto &list : lists) {
+        while (list) {
+            auto next = list->next;
+            free(list);
+            list = next;
+        }
+    }
+    cache_destroyed = true;
+}
+
+void *pool_malloc(int bytes)
+{
+    if (bytes <= 0) {
+        return nullptr;
+    }
+    const auto size_class = size_class_of(bytes);
+    Header *header;
+    if (size_class == large_class) {
+        header = static_cast<Header *>(malloc(sizeof(Header) + ((bytes + 7) & ~7)));
+        if (!header) {
+            return nullptr;
+        }
+        header->size = (bytes + 7) & ~7;
+    }
+    else {
+        if (!cache_destroyed && cache.lists[size_class]) {
+            auto block = cache.lists[size_class];
+            cache.lists[size_class] = block->next;
+            --cache.counts[size_class];
+            header = reinterpret_cast<Header *>(block);
+        }
+        else {
+            header = static_cast<Header *>(malloc(block_size(size_class)));
+            if (!header) {
+                return nullptr;
+            }
+        }
+        header->size = block_size(size_class) - sizeof(Header);
+    }
+    header->size_class = size_class;
+    return header + 1;
+}
+
+void pool_free(void *ptr)
+{
+    if (!ptr) {
+        return;
+    }
+    auto header = static_cast<Header *>(ptr) - 1;
+    const auto size_class = header->size_class;
+    if (size_class == large_class || cache_destroyed || cache.counts[size_class] >= max_cached_blocks) {
+        free(header);
+        return;
+    }
+    auto block = reinterpret_cast<FreeBlock *>(header);
+    block->next = cache.lists[size_class];
+    cache.lists[size_class] = block;
+    ++cache.counts[size_class];
+}
+
+int pool_size(void *ptr)
+{
+    return ptr ? static_cast<int>((static_cast<Header *>(ptr) - 1)->size) : 0;
+}
+
+void *pool_realloc(void *ptr, int bytes)
+{
+    if (!ptr) {
+        return pool_malloc(bytes);
+    }
+    const auto old_size = pool_size(ptr);
+    if (bytes <= old_size && size_class_of(bytes) == (static_cast<Header *>(ptr) - 1)->size_class) {
+        return ptr;
+    }
+    auto new_ptr = pool_malloc(bytes);
+    if (new_ptr) {
+        memcpy(new_ptr, ptr, old_size < bytes ? old_size : bytes);
+        pool_free(ptr);
+    }
+    return new_ptr;
+}
+
+int pool_roundup(int bytes)
+{
+    const auto size_class = size_class_of(bytes);
+    if (size_class == large_class) {
+        return (bytes + 7) & ~7;
+    }
+    return block_size(size_class) - sizeof(Header);
+}
+
+int pool_init(void *)
+{
+    return SQLITE_OK;
+}
+
+void pool_shutdown(void *)
+{
+
+}
+
+const sqlite3_mem_methods methods = {
+    pool_malloc,
+    pool_free,
+    pool_realloc,
+    pool_size,
+    pool_roundup,
+    pool_init,
+    pool_shutdown,
+    nullptr,
+};
+
+} // namespace
+
+
+
+const sqlite3_mem_methods &pool_allocator_methods() noexcept
+{
+    return methods;
+}
@@ -0,0 +1,397 @@
+/*
+Sqlite Database wrapper for Modern C++
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+SPDX-License-Identifier: MIT
+
+Copyright (c) 2020 Ivan Volnov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <src/result_cache.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <iterator>
+#include <limits>
+
+
+
+// Builtin functions returning the same value for the same arguments. Any other function, e.g. random(),
+// current_timestamp or the date functions that read 'now', makes the statement uncacheable
+static constexpr const char *deterministic_functions[] = {
+    "abs", "char", "coalesce", "glob", "hex", "ifnull", "iif", "instr", "length", "like", "likelihood", "likely",
+    "lower", "ltrim", "max", "min", "nullif", "printf", "quote", "replace", "round", "rtrim", "soundex",
+    "sqlite_compileoption_get", "sqlite_compileoption_used", "sqlite_source_id", "sqlite_version", "substr",
+    "trim", "typeof", "unicode", "unlikely", "upper", "zeroblob",
+    "avg", "count", "group_concat", "sum", "total",
+    "row_number", "rank", "dense_rank", "percent_rank", "cume_dist", "ntile", "lag", "lead",
+    "first_value", "last_value", "nth_value",
+    "json", "json_array", "json_array_length", "json_extract", "json_insert", "json_object", "json_patch",
+    "json_quote", "json_remove", "json_replace", "json_set", "json_type", "json_valid",
+    "json_group_array", "json_group_object",
+};
+
+ResultCache::ResultCache(sqlite3 *db, size_t max_bytes, const std::unordered_map<std::string, bool> &functions) MAYTHROW :
+    db(db), max_bytes(max_bytes), functions(functions)
+{
+    if (sqlite3_prepare_v3(db, "SELECT * FROM pragma_data_version, pragma_schema_version", -1,
+                           SQLITE_PREPARE_PERSISTENT, &version_stmt, nullptr) != SQLITE_OK) {
+        throw DatabaseException(db);
+    }
+    // The authorizer stays installed: setting it expires all prepared statements
+    sqlite3_set_authorizer(db, &ResultCache::authorize, this);
+    sqlite3_update_hook(db, &ResultCache::on_update, this);
+    sqlite3_commit_hook(db, &ResultCache::on_commit, this);
+    sqlite3_rollback_hook(db, &ResultCache::on_rollback, this);
+    stats.memory_limit = max_bytes;
+    validate();
+}
+
+ResultCache::~ResultCache()
+{
+    sqlite3_set_authorizer(db, nullptr, nullptr);
+    sqlite3_update_hook(db, nullptr, nullptr);
+    sqlite3_commit_hook(db, nullptr, nullptr);
+    sqlite3_rollback_hook(db, nullptr, nullptr);
+    sqlite3_finalize(version_stmt);
+}
+
+std::shared_ptr<const CachedResult> ResultCache::find(const std::string &key) noexcept
+{
+    validate();
+    auto it = index.find(key);
+    if (it == index.end()) {
+        ++stats.misses;
+        return nullptr;
+    }
+    ++stats.hits;
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->result;
+}
+
+const std::vector<std::string> *ResultCache::get_tables(const char *sql) MAYTHROW
+{
+    auto it = statement_tables.find(sql);
+    if (it == statement_tables.end()) {
+        // Preparing a copy once reports all tables read by the statement, including the ones behind views
+        StatementTables tables;
+        collecting = &tables;
+        sqlite3_stmt *stmt = nullptr;
+        const int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+        collecting = nullptr;
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_OK) {
+            throw DatabaseException(db);
+        }
+        it = statement_tables.emplace(sql, std::move(tables)).first;
+    }
+    if (!it->second.cacheable) {
+        return nullptr;
+    }
+    for (const auto &table : it->second.tables) {
+        if (written_tables.count(table)) {
+            return nullptr;
+        }
+    }
+    return &it->second.tables;
+}
+
+void ResultCache::insert(std::string key, const std::vector<std::string> &tables, std::shared_ptr<const CachedResult> result)
+{
+    const size_t size = sizeof(Entry) + key.size() + result->get_memory_usage();
+    if (size > max_bytes) {
+        return;
+    }
+    if (auto it = index.find(key); it != index.end()) {
+        erase(it->second);
+    }
+    while (memory_usage + size > max_bytes && !entries.empty()) {
+        ++stats.evictions;
+        erase(std::prev(entries.end()));
+    }
+    entries.push_front(Entry{std::move(key), std::move(result), &tables, size});
+    const auto &entry = entries.front();
+    index.emplace(entry.key, entries.begin());
+    for (const auto &table : tables) {
+        table_entries[table].insert(&entry);
+    }
+    memory_usage += size;
+}
+
+void ResultCache::forget_statements() noexcept
+{
+    stats.invalidations += entries.size();
+    clear();
+    statement_tables.clear();
+}
+
+void ResultCache::clear() noexcept
+{
+    entries.clear();
+    index.clear();
+    table_entries.clear();
+    memory_usage = 0;
+}
+
+ResultCacheStats ResultCache::get_stats() const noexcept
+{
+    auto result = stats;
+    result.entries = entries.size();
+    result.memory_usage = memory_usage;
+    return result;
+}
+
+int ResultCache::authorize(void *context, int action, const char *arg1, const char *arg2, const char *, const char *) noexcept
+{
+    auto self = static_cast<ResultCache *>(context);
+    auto tables = self->collecting;
+    if (!tables) {
+        return SQLITE_OK;
+    }
+    try {
+        switch (action) {
+        case SQLITE_READ:
+            if (arg1 && std::find(tables->tables.begin(), tables->tables.end(), arg1) == tables->tables.end()) {
+                tables->tables.emplace_back(arg1);
+            }
+            break;
+        case SQLITE_FUNCTION:
+            if (!self->is_deterministic(arg2)) {
+                tables->cacheable = false;
+            }
+            break;
+        case SQLITE_SELECT:
+        case SQLITE_RECURSIVE:
+            break;
+        default:
+            // Pragmas, attaching and anything that isn't a plain read
+            tables->cacheable = false;
+            break;
+        }
+    } catch (...) {
+        tables->cacheable = false;
+    }
+    return SQLITE_OK;
+}
+
+bool ResultCache::is_deterministic(const char *function) const
+{
+    if (!function) {
+        return false;
+    }
+    std::string name(function);
+    std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+    // Registered functions override the builtins with the same name
+    if (auto it = functions.find(name); it != functions.end()) {
+        return it->second;
+    }
+    for (auto builtin : deterministic_functions) {
+        if (name == builtin) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ResultCache::on_update(void *context, int, const char *, const char *table, sqlite3_int64) noexcept
+{
+    auto self = static_cast<ResultCache *>(context);
+    ++self->expected_total_changes;
+    self->invalidate(table);
+}
+
+int ResultCache::on_commit(void *context) noexcept
+{
+    static_cast<ResultCache *>(context)->written_tables.clear();
+    return 0;
+}
+
+void ResultCache::on_rollback(void *context) noexcept
+{
+    static_cast<ResultCache *>(context)->written_tables.clear();
+}
+
+void ResultCache::validate() noexcept
+{
+    int64_t data = -1;
+    int64_t schema = -1;
+    if (sqlite3_step(version_stmt) == SQLITE_ROW) {
+        data = sqlite3_column_int64(version_stmt, 0);
+        schema = sqlite3_column_int64(version_stmt, 1);
+    }
+    sqlite3_reset(version_stmt);
+    const int64_t total_changes = sqlite3_total_changes(db);
+    if (data == data_version && schema == schema_version && total_changes == expected_total_changes && data >= 0) {
+        return;
+    }
+    stats.invalidations += entries.size();
+    clear();
+    if (schema != schema_version) {
+        statement_tables.clear();
+    }
+    data_version = data;
+    schema_version = schema;
+    expected_total_changes = total_changes;
+}
+
+void ResultCache::invalidate(const char *table) noexcept
+{
+    try {
+        if (!sqlite3_get_autocommit(db)) {
+            written_tables.emplace(table);
+        }
+        auto it = table_entries.find(table);
+        if (it == table_entries.end()) {
+            return;
+        }
+        // erase() updates the set, iterate over a copy
+        const std::vector<const Entry *> dropped(it->second.begin(), it->second.end());
+        for (auto entry : dropped) {
+            ++stats.invalidations;
+            erase(index.find(entry->key)->second);
+        }
+    } catch (...) {
+        stats.invalidations += entries.size();
+        clear();
+    }
+}
+
+void ResultCache::erase(EntryList::iterator it) noexcept
+{
+    for (const auto &table : *it->tables) {
+        if (auto tables = table_entries.find(table); tables != table_entries.end()) {
+            tables->second.erase(&*it);
+            if (tables->second.empty()) {
+                table_entries.erase(tables);
+            }
+        }
+    }
+    memory_usage -= it->memory_usage;
+    index.erase(it->key);
+    entries.erase(it);
+}
+
+
+
+int64_t CachedResult::get_int64(size_t row, size_t col) const noexcept
+{
+    const auto &cell = cells[row * columns + col];
+    switch (get_type(row, col)) {
+    case Integer:
+        return cell.integer;
+    case Float:
+        return static_cast<int64_t>(cell.real);
+    case Text:
+        return std::strtoll(std::string(get_string_view(row, col)).c_str(), nullptr, 10);
+    default:
+        return 0;
+    }
+}
+
+double CachedResult::get_double(size_t row, size_t col) const noexcept
+{
+    const auto &cell = cells[row * columns + col];
+    switch (get_type(row, col)) {
+    case Integer:
+        return static_cast<double>(cell.integer);
+    case Float:
+        return cell.real;
+    case Text:
+        return std::strtod(std::string(get_string_view(row, col)).c_str(), nullptr);
+    default:
+        return 0;
+    }
+}
+
+std::string CachedResult::get_string(size_t row, size_t col) const
+{
+    switch (get_type(row, col)) {
+    case Integer:
+        return std::to_string(cells[row * columns + col].integer);
+    case Float: {
+        char buffer[32];
+        sqlite3_snprintf(sizeof(buffer), buffer, "%!.15g", cells[row * columns + col].real);
+        return buffer;
+    }
+    default:
+        return std::string(get_string_view(row, col));
+    }
+}
+
+std::string_view CachedResult::get_string_view(size_t row, size_t col) const noexcept
+{
+    const auto type = get_type(row, col);
+    if (type != Text && type != Blob) {
+        return {};
+    }
+    const auto &cell = cells[row * columns + col];
+    return std::string_view(data.data() + cell.bytes.offset, cell.bytes.length);
+}
+
+BlobView CachedResult::get_blob(size_t row, size_t col) const noexcept
+{
+    const auto value = get_string_view(row, col);
+    return BlobView(value.data(), value.size());
+}
+
+size_t CachedResult::get_memory_usage() const noexcept
+{
+    return sizeof(CachedResult) + types.capacity() + cells.capacity() * sizeof(Cell) + data.capacity();
+}
+
+void CachedResult::add_row(sqlite3_stmt *stmt)
+{
+    for (size_t col = 0; col < columns; ++col) {
+        const int idx = static_cast<int>(col);
+        Cell cell;
+        const auto type = sqlite3_column_type(stmt, idx);
+        switch (type) {
+        case SQLITE_INTEGER:
+            cell.integer = sqlite3_column_int64(stmt, idx);
+            types.push_back(Integer);
+            break;
+        case SQLITE_FLOAT:
+            cell.real = sqlite3_column_double(stmt, idx);
+            types.push_back(Float);
+            break;
+        case SQLITE_TEXT:
+        case SQLITE_BLOB: {
+            const void *value = type == SQLITE_TEXT ? static_cast<const void *>(sqlite3_column_text(stmt, idx))
+                                                    : sqlite3_column_blob(stmt, idx);
+            const auto length = static_cast<size_t>(sqlite3_column_bytes(stmt, idx));
+            if (data.size() + length > std::numeric_limits<uint32_t>::max()) {
+                throw DatabaseException("Result is too big to be cached");
+            }
+            cell.bytes.offset = static_cast<uint32_t>(data.size());
+            cell.bytes.length = static_cast<uint32_t>(length);
+            data.append(static_cast<const char *>(value), length);
+            types.push_back(type == SQLITE_TEXT ? Text : Blob);
+            break;
+        }
+        default:
+            cell.integer = 0;
+            types.push_back(Null);
+            break;
+        }
+        cells.push_back(cell);
+    }
+    ++rows;
+}
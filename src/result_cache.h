@@ -0,0 +1,107 @@
+/*
+Sqlite Database wrapper for Modern C++
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+SPDX-License-Identifier: MIT
+
+Copyright (c) 2020 Ivan Volnov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <sqlite_database/sqlite_database.h>
+#include <libs/sqlite3/sqlite3.h>
+#include <unordered_set>
+
+
+
+// Result cache of a single connection, see SqliteDatabase::enable_result_cache()
+class ResultCache
+{
+public:
+    // functions are the names of the registered functions with their determinism, see SqliteDatabase::create_function()
+    ResultCache(sqlite3 *db, size_t max_bytes, const std::unordered_map<std::string, bool> &functions) MAYTHROW;
+    ~ResultCache();
+    ResultCache(const ResultCache &) = delete;
+    ResultCache &operator=(const ResultCache &) = delete;
+
+    std::shared_ptr<const CachedResult> find(const std::string &key) noexcept;
+    // Tables read by the statement, nullptr if its result can't be cached
+    const std::vector<std::string> *get_tables(const char *sql) MAYTHROW;
+    void insert(std::string key, const std::vector<std::string> &tables, std::shared_ptr<const CachedResult> result);
+    void clear() noexcept;
+    // Drops the entries with the collected tables of every statement, a registered function may change its cacheability
+    void forget_statements() noexcept;
+    ResultCacheStats get_stats() const noexcept;
+
+private:
+    struct Entry
+    {
+        std::string key;
+        std::shared_ptr<const CachedResult> result;
+        const std::vector<std::string> *tables;
+        size_t memory_usage;
+    };
+    using EntryList = std::list<Entry>;
+
+    struct StatementTables
+    {
+        std::vector<std::string> tables;
+        bool cacheable = true;
+    };
+
+    // Whether the function returns the same value for the same arguments. Unknown functions aren't
+    bool is_deterministic(const char *function) const;
+    static int authorize(void *context, int action, const char *arg1, const char *arg2, const char *, const char *) noexcept;
+    static void on_update(void *context, int, const char *, const char *table, sqlite3_int64) noexcept;
+    static int on_commit(void *context) noexcept;
+    static void on_rollback(void *context) noexcept;
+
+    // Drops everything if another connection has committed, the schema has changed
+    // or there were changes the update hook hasn't reported
+    void validate() noexcept;
+    void invalidate(const char *table) noexcept;
+    void erase(EntryList::iterator it) noexcept;
+
+    sqlite3 *db;
+    const size_t max_bytes;
+    const std::unordered_map<std::string, bool> &functions;
+    sqlite3_stmt *version_stmt = nullptr;
+    int64_t data_version = 0;
+    int64_t schema_version = 0;
+    int64_t expected_total_changes = 0;
+
+    // most recently used entries are at the front
+    EntryList entries;
+    std::unordered_map<std::string_view, EntryList::iterator> index;
+    std::unordered_map<std::string, std::unordered_set<const Entry *>> table_entries;
+    std::unordered_map<std::string, StatementTables> statement_tables;
+    // Tables written by the open transaction. Results reading them aren't cached until it ends,
+    // they could include writes that are rolled back
+    std::unordered_set<std::string> written_tables;
+    StatementTables *collecting = nullptr;
+    size_t memory_usage = 0;
+    ResultCacheStats stats;
+};
+
+
+#endif // RESULT_CACHE_H
@@ -27,8 +27,296 @@ SOFTWARE.
 
 #include <sqlite_database/sqlite_database.h>
 #include <libs/sqlite3/sqlite3.h>
+#include <src/pool_allocator.h>
+#include <src/result_cache.h>
+#ifdef SQLITE_DATABASE_ENABLE_SESSION
+#include <sqlite_database/change_capture.h>
+#endif
 #include <iostream>
 #include <vector>
+#include <limits>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <cmath>
+#include <unordered_set>
+#include <utility>
+
+
+
+SqlBuffer::SqlBuffer() noexcept :
+    buffer(storage)
+{
+    storage[0] = '\0';
+}
+
+SqlBuffer::~SqlBuffer()
+{
+    if (buffer != storage) {
+        delete[] buffer;
+    }
+}
+
+void SqlBuffer::append(const char *str, size_t len)
+{
+    if (length + len > capacity) {
+        grow(length + len);
+    }
+    memcpy(buffer + length, str, len);
+    length += len;
+    buffer[length] = '\0';
+}
+
+void SqlBuffer::append_separator()
+{
+    if (length && !isspace(static_cast<unsigned char>(buffer[length - 1]))) {
+        append(' ');
+    }
+}
+
+void SqlBuffer::grow(size_t required)
+{
+    const auto new_capacity = std::max(required, capacity * 2);
+    auto new_buffer = new char[new_capacity + 1];
+    memcpy(new_buffer, buffer, length + 1);
+    if (buffer != storage) {
+        delete[] buffer;
+    }
+    buffer = new_buffer;
+    capacity = new_capacity;
+}
+
+
+
+MonotonicArena::MonotonicArena(size_t initial_size) noexcept :
+    next_size(std::max<size_t>(initial_size, 64))
+{
+
+}
+
+MonotonicArena::~MonotonicArena()
+{
+    while (chunks) {
+        auto next = chunks->next;
+        ::operator delete(chunks);
+        chunks = next;
+    }
+}
+
+void MonotonicArena::reset() noexcept
+{
+    if (!chunks) {
+        return;
+    }
+    // Keep the newest chunk, it's the largest one
+    auto chunk = chunks->next;
+    while (chunk) {
+        auto next = chunk->next;
+        ::operator delete(chunk);
+        chunk = next;
+    }
+    chunks->next = nullptr;
+    ptr = reinterpret_cast<char *>(chunks + 1);
+}
+
+void *MonotonicArena::do_allocate(size_t bytes, size_t alignment)
+{
+    auto aligned = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(ptr) + alignment - 1) & ~(alignment - 1));
+    if (!ptr || aligned + bytes > end) {
+        const auto size = std::max(next_size, bytes + alignment);
+        auto chunk = static_cast<Chunk *>(::operator new(sizeof(Chunk) + size));
+        chunk->next = chunks;
+        chunks = chunk;
+        ptr = reinterpret_cast<char *>(chunk + 1);
+        end = ptr + size;
+        next_size = size * 2;
+        aligned = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(ptr) + alignment - 1) & ~(alignment - 1));
+    }
+    ptr = aligned + bytes;
+    return aligned;
+}
+
+void MonotonicArena::do_deallocate(void *, size_t, size_t) noexcept
+{
+
+}
+
+bool MonotonicArena::do_is_equal(const std::pmr::memory_resource &other) const noexcept
+{
+    return this == &other;
+}
+
+
+
+class QueryProfiler
+{
+public:
+    // The sql text is kept by the entry, profile.sql is only filled in snapshots
+    struct Entry
+    {
+        std::string sql;
+        StatementProfile profile;
+    };
+
+    StatementProfile &get_statement(std::string_view sql)
+    {
+        if (auto it = statements.find(sql); it != statements.end()) {
+            return it->second->profile;
+        }
+        auto entry = std::make_unique<Entry>();
+        entry->sql = sql;
+        const auto key = std::string_view(entry->sql);
+        return statements.emplace(key, std::move(entry)).first->second->profile;
+    }
+
+    static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) noexcept
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    static void add_latency(LatencyHistogram &histogram, uint64_t ns) noexcept
+    {
+        size_t bucket = 0;
+        while (ns >>= 1) {
+            ++bucket;
+        }
+        ++histogram[std::min(bucket, histogram.size() - 1)];
+    }
+
+    static int trace(unsigned type, void *ctx, void *p, void *x)
+    {
+        if (type == SQLITE_TRACE_PROFILE) {
+            auto self = static_cast<QueryProfiler *>(ctx);
+            if (auto sql = sqlite3_sql(static_cast<sqlite3_stmt *>(p))) {
+                try {
+                    auto &profile = self->get_statement(sql);
+                    ++profile.run_count;
+                    profile.run_ns += *static_cast<int64_t *>(x);
+                } catch (...) {
+                }
+            }
+        }
+        return 0;
+    }
+
+    void reset() noexcept
+    {
+        for (auto &[sql, entry] : statements) {
+            entry->profile = StatementProfile();
+        }
+        commit_count = 0;
+        commit_ns = 0;
+        commit_histogram = {};
+    }
+
+    std::unordered_map<std::string_view, std::unique_ptr<Entry>> statements;
+    uint64_t commit_count = 0;
+    uint64_t commit_ns = 0;
+    LatencyHistogram commit_histogram = {};
+};
+
+
+
+static QueryPlan explain_query_plan(sqlite3 *db, std::string_view sql) MAYTHROW
+{
+    QueryPlan plan;
+    std::string explain = "EXPLAIN QUERY PLAN ";
+    explain.append(sql);
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, explain.c_str(), static_cast<int>(explain.size()), &stmt, nullptr) != SQLITE_OK) {
+        throw DatabaseException(db);
+    }
+    int res;
+    while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+        auto &step = plan.steps.emplace_back();
+        step.id = sqlite3_column_int(stmt, 0);
+        step.parent = sqlite3_column_int(stmt, 1);
+        if (auto detail = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 3))) {
+            step.detail = detail;
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (res != SQLITE_DONE) {
+        throw DatabaseException(db);
+    }
+    return plan;
+}
+
+bool QueryPlan::has_full_scan() const noexcept
+{
+    for (const auto &step : steps) {
+        if (step.detail.compare(0, 11, "SCAN TABLE ") == 0 && step.detail.find(" VIRTUAL TABLE ") == std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string QueryPlan::to_string() const
+{
+    std::string result;
+    // steps are listed after their parents
+    std::unordered_map<int, size_t> depths;
+    for (const auto &step : steps) {
+        auto it = depths.find(step.parent);
+        const size_t depth = it != depths.end() ? it->second + 1 : 0;
+        depths[step.id] = depth;
+        result.append(depth * 2, ' ');
+        result += step.detail;
+        result += '\n';
+    }
+    return result;
+}
+
+
+
+class SlowQueryLog
+{
+public:
+    void report(sqlite3 *db, sqlite3_stmt *stmt, std::string_view sql, uint64_t run_ns)
+    {
+        const auto fullscan_steps = static_cast<uint64_t>(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0));
+        if (run_ns < threshold_ns && !(options.report_full_scans && fullscan_steps > 0)) {
+            return;
+        }
+        if (!reported.emplace(sql).second) {
+            return;
+        }
+        SlowQuery query;
+        query.sql = sql;
+        if (auto expanded = sqlite3_expanded_sql(stmt)) {
+            query.expanded_sql = expanded;
+            sqlite3_free(expanded);
+        }
+        query.run_ns = run_ns;
+        query.fullscan_steps = fullscan_steps;
+        try {
+            query.plan = explain_query_plan(db, sql);
+        } catch (const DatabaseException &) {
+            // e.g. the schema has changed under the statement, it's reported without the plan
+        }
+        if (options.logger) {
+            options.logger(query);
+        }
+        else {
+            std::cerr << "Slow query: " << query.run_ns / 1000000.0 << " ms, " << query.fullscan_steps
+                      << " full scan steps: " << (query.expanded_sql.empty() ? query.sql : query.expanded_sql)
+                      << '\n' << query.plan.to_string() << std::flush;
+        }
+    }
+
+    void set_options(SlowQueryOptions value)
+    {
+        options = std::move(value);
+        threshold_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(options.threshold).count();
+    }
+
+private:
+    SlowQueryOptions options;
+    uint64_t threshold_ns = 0;
+    std::unordered_set<std::string> reported;
+};
 
 
 
@@ -40,18 +328,16 @@ Query::Query(std::shared_ptr<SqliteDatabase> database) :
 
 Query::~Query()
 {
-    sqlite3_finalize(stmt);
+    release();
 }
 
 Query &Query::operator<<(const char *value)
 {
-    if (!value) {
+    if (!value || !*value) {
         return *this;
     }
-    if (!ss.str().empty() && !isspace(ss.str().back())) {
-        ss << ' ';
-    }
-    ss << value;
+    sql.append_separator();
+    sql.append(value, strlen(value));
     return *this;
 }
 
@@ -60,27 +346,23 @@ Query &Query::operator<<(const std::string &value)
     if (value.empty()) {
         return *this;
     }
-    if (!ss.str().empty() && !isspace(ss.str().back())) {
-        ss << ' ';
-    }
-    ss << value;
+    sql.append_separator();
+    sql.append(value);
     return *this;
 }
 
 Query &Query::add_array(size_t columns) MAYTHROW
 {
-    if (!ss.str().empty() && !isspace(ss.str().back())) {
-        ss << ' ';
-    }
+    sql.append_separator();
     if (columns > 0) {
         for (size_t i = 0; i < columns; ++i) {
-            ss << (i ? ",?" : "(?");
+            sql.append(i ? ",?" : "(?", 2);
         }
     }
     else {
-        ss << '(';
+        sql.append('(');
     }
-    ss << ')';
+    sql.append(')');
     return *this;
 }
 
@@ -88,7 +370,7 @@ Query &Query::add_array(size_t columns, size_t rows) MAYTHROW
 {
     for (size_t i = 0; i < rows; ++i) {
         if (i) {
-            ss << ',';
+            sql.append(',');
         }
         add_array(columns);
     }
@@ -97,12 +379,96 @@ Query &Query::add_array(size_t columns, size_t rows) MAYTHROW
 
 void Query::prepare() MAYTHROW
 {
-    if (sqlite3_prepare_v2(database->db, ss.str().c_str(), ss.str().size(), &stmt, nullptr) != SQLITE_OK) {
-        throw DatabaseException(database->db);
+    if (database->profiling) {
+        profile = &database->profiler->get_statement(sql.view());
+        const auto start = std::chrono::steady_clock::now();
+        stmt = database->acquire_statement(sql.view());
+        ++profile->prepare_count;
+        profile->prepare_ns += QueryProfiler::elapsed_ns(start);
+    }
+    else {
+        stmt = database->acquire_statement(sql.view());
+    }
+    if (database->slow_query_logging) {
+        slow_log = database->slow_query_log.get();
+        run_ns = 0;
     }
     col_count = sqlite3_column_count(stmt);
 }
 
+void Query::release() noexcept
+{
+    if (!stmt) {
+        return;
+    }
+    if (run_ns) {
+        finish_run();
+    }
+    slow_log = nullptr;
+    if (profile) {
+        profile->vm_steps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+        profile->fullscan_steps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+        profile->sorts += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+        profile->autoindexes += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+        profile = nullptr;
+    }
+    database->release_statement(sql.view(), stmt);
+    stmt = nullptr;
+    owned_values.clear();
+    bound_values.clear();
+    untracked_bindings = false;
+}
+
+Query::OwnedValue Query::own_value(int idx, OwnedValue value) MAYTHROW
+{
+    if (owned_values.empty()) {
+        owned_values.resize(sqlite3_bind_parameter_count(stmt));
+    }
+    if (idx < 1 || static_cast<size_t>(idx) > owned_values.size()) {
+        throw DatabaseException(DatabaseStatus(SQLITE_RANGE));
+    }
+    return std::exchange(owned_values[idx - 1], std::move(value));
+}
+
+Query::OwnedValue Query::take_owned_value(int idx) noexcept
+{
+    if (idx < 1 || static_cast<size_t>(idx) > owned_values.size()) {
+        return OwnedValue();
+    }
+    return std::exchange(owned_values[idx - 1], OwnedValue());
+}
+
+void Query::record_binding(int type, const void *data, size_t size) noexcept
+{
+    if (!database->result_cache) {
+        // the values bound before the cache was enabled aren't known
+        untracked_bindings = true;
+        return;
+    }
+    try {
+        if (bound_values.empty()) {
+            // unbound parameters are null
+            bound_values.resize(sqlite3_bind_parameter_count(stmt), std::string(1, static_cast<char>(SQLITE_NULL)));
+        }
+        if (bind_idx < 1 || static_cast<size_t>(bind_idx) > bound_values.size()) {
+            return;
+        }
+        auto &value = bound_values[bind_idx - 1];
+        value.assign(1, static_cast<char>(type));
+        value.append(static_cast<const char *>(data), size);
+    } catch (...) {
+        untracked_bindings = true;
+    }
+}
+
+void Query::restore_owned_value(int idx, OwnedValue value) noexcept
+{
+    // the failed bind didn't replace the binding, the statement may still point to the value
+    if (!std::holds_alternative<std::monostate>(value)) {
+        owned_values[idx - 1] = std::move(value);
+    }
+}
+
 Query &Query::bind(const char *str, bool constant) MAYTHROW
 {
     if (!stmt) {
@@ -111,6 +477,7 @@ Query &Query::bind(const char *str, bool constant) MAYTHROW
     if (sqlite3_bind_text(stmt, ++bind_idx, str, -1, constant ? SQLITE_STATIC : SQLITE_TRANSIENT) != SQLITE_OK) {
         throw DatabaseException(database->db);
     }
+    record_binding(str ? SQLITE_TEXT : SQLITE_NULL, str, str ? strlen(str) : 0);
     return *this;
 }
 
@@ -122,6 +489,37 @@ Query &Query::bind(const std::string &str, bool constant) MAYTHROW
     if (sqlite3_bind_text(stmt, ++bind_idx, str.c_str(), str.size(), constant ? SQLITE_STATIC : SQLITE_TRANSIENT) != SQLITE_OK) {
         throw DatabaseException(database->db);
     }
+    record_binding(SQLITE_TEXT, str.data(), str.size());
+    return *this;
+}
+
+Query &Query::bind(std::string &&str) MAYTHROW
+{
+    // Short strings are cheaper to copy than to keep
+    if (str.size() < 256) {
+        return bind(std::string_view(str));
+    }
+    if (!stmt) {
+        prepare();
+    }
+    // moved strings keep their heap buffer, so the bound pointer stays valid in the slot
+    const auto data = str.data();
+    const auto size = str.size();
+    auto previous = own_value(++bind_idx, std::move(str));
+    if (sqlite3_bind_text64(stmt, bind_idx, data, size, SQLITE_STATIC, SQLITE_UTF8) != SQLITE_OK) {
+        // the statement may still point to the previous value
+        own_value(bind_idx, std::move(previous));
+        throw DatabaseException(database->db);
+    }
+    record_binding(SQLITE_TEXT, data, size);
+    return *this;
+}
+
+Query &Query::bind(std::string_view str, bool constant) MAYTHROW
+{
+    if (try_bind(str, constant).is_error()) {
+        throw DatabaseException(database->db);
+    }
     return *this;
 }
 
@@ -133,6 +531,8 @@ Query &Query::bind(int32_t value) MAYTHROW
     if (sqlite3_bind_int(stmt, ++bind_idx, value) != SQLITE_OK) {
         throw DatabaseException(database->db);
     }
+    const int64_t integer = value;
+    record_binding(SQLITE_INTEGER, &integer, sizeof(integer));
     return *this;
 }
 
@@ -143,10 +543,7 @@ Query &Query::bind(uint32_t value) MAYTHROW
 
 Query &Query::bind(int64_t value) MAYTHROW
 {
-    if (!stmt) {
-        prepare();
-    }
-    if (sqlite3_bind_int64(stmt, ++bind_idx, value) != SQLITE_OK) {
+    if (try_bind(value).is_error()) {
         throw DatabaseException(database->db);
     }
     return *this;
@@ -160,262 +557,2001 @@ Query &Query::bind(uint64_t value) MAYTHROW
     return bind(static_cast<int64_t>(value));
 }
 
-Query &Query::bind() MAYTHROW
+Query &Query::bind(double value) MAYTHROW
 {
-    if (!stmt) {
-        prepare();
-    }
-    if (sqlite3_bind_null(stmt, ++bind_idx) != SQLITE_OK) {
+    if (try_bind(value).is_error()) {
         throw DatabaseException(database->db);
     }
     return *this;
 }
 
-bool Query::step() MAYTHROW
+Query &Query::bind(BlobView blob, bool constant) MAYTHROW
 {
-    if (!stmt) {
-        prepare();
-    }
-    col_idx = 0;
-    switch (sqlite3_step(stmt)) {
-    case SQLITE_ROW:
-        return true;
-    case SQLITE_DONE:
-        return false;
-    default:
+    return bind_blob(blob.data(), blob.size(), constant);
+}
+
+Query &Query::bind_blob(const void *data, size_t size, bool constant) MAYTHROW
+{
+    if (try_bind(BlobView(data, size), constant).is_error()) {
         throw DatabaseException(database->db);
     }
+    return *this;
 }
 
-Query &Query::step(Query &query) MAYTHROW
+Query &Query::bind_blob(const std::vector<uint8_t> &blob, bool constant) MAYTHROW
 {
-    query.step();
-    return query;
+    return bind_blob(blob.data(), blob.size(), constant);
 }
 
-
-
-Query &Query::reset() noexcept
+Query &Query::bind_blob(std::vector<uint8_t> &&blob) MAYTHROW
 {
-    sqlite3_finalize(stmt);
-    ss = std::stringstream();
-    stmt = nullptr;
-    bind_idx = 0;
-    col_idx = 0;
-    col_count = 0;
+    if (blob.size() < 256) {
+        return bind_blob(blob.data(), blob.size());
+    }
+    if (!stmt) {
+        prepare();
+    }
+    const auto data = blob.data();
+    const auto size = blob.size();
+    auto previous = own_value(++bind_idx, std::move(blob));
+    if (sqlite3_bind_blob64(stmt, bind_idx, data, size, SQLITE_STATIC) != SQLITE_OK) {
+        // the statement may still point to the previous value
+        own_value(bind_idx, std::move(previous));
+        throw DatabaseException(database->db);
+    }
+    record_binding(SQLITE_BLOB, data, size);
     return *this;
 }
 
-Query &Query::clear_bindings() noexcept
+Query &Query::bind_blob(std::unique_ptr<uint8_t[]> data, size_t size) MAYTHROW
 {
-    if (stmt) {
-        sqlite3_reset(stmt);
-        sqlite3_clear_bindings(stmt);
+    if (!stmt) {
+        prepare();
     }
-    bind_idx = 0;
-    col_idx = 0;
+    // sqlite calls the destructor even if binding fails
+    const auto destructor = [](void *ptr) {
+        delete[] static_cast<uint8_t *>(ptr);
+    };
+    if (!data) {
+        return bind_blob(nullptr, 0);
+    }
+    const auto ptr = data.get();
+    if (sqlite3_bind_blob64(stmt, ++bind_idx, data.release(), size, destructor) != SQLITE_OK) {
+        throw DatabaseException(database->db);
+    }
+    record_binding(SQLITE_BLOB, ptr, size);
     return *this;
 }
 
-bool Query::is_null() const noexcept
+Query &Query::bind_zeroblob(uint64_t size) MAYTHROW
 {
-    return sqlite3_column_type(stmt, col_idx) == SQLITE_NULL;
+    if (!stmt) {
+        prepare();
+    }
+    if (sqlite3_bind_zeroblob64(stmt, ++bind_idx, size) != SQLITE_OK) {
+        throw DatabaseException(database->db);
+    }
+    // a blob of zeroes is keyed by its size
+    record_binding(SQLITE_BLOB + 'z', &size, sizeof(size));
+    return *this;
 }
 
-Query &Query::skip() MAYTHROW
+Query &Query::bind() MAYTHROW
 {
-    if (col_idx >= col_count) {
-        throw DatabaseException("Column is out of range");
+    if (try_bind().is_error()) {
+        throw DatabaseException(database->db);
     }
-    ++col_idx;
     return *this;
 }
 
-std::string Query::get_string() MAYTHROW
+DatabaseStatus Query::try_bind(std::string_view str, bool constant) MAYTHROW
 {
-    if (col_idx >= col_count) {
-        throw DatabaseException("Column is out of range");
+    if (!stmt) {
+        prepare();
+    }
+    // A null pointer would bind NULL instead of an empty string
+    const int res = sqlite3_bind_text64(stmt, ++bind_idx, str.data() ? str.data() : "", str.size(),
+                                        constant ? SQLITE_STATIC : SQLITE_TRANSIENT, SQLITE_UTF8);
+    if (res == SQLITE_OK) {
+        record_binding(SQLITE_TEXT, str.data(), str.size());
     }
-    auto str = reinterpret_cast<const char *>(sqlite3_column_text(stmt, col_idx++));
-    return str ? str : "";
+    return DatabaseStatus(res, database->db);
 }
 
-int32_t Query::get_int32() MAYTHROW
+DatabaseStatus Query::try_bind(int64_t value) MAYTHROW
 {
-    if (col_idx >= col_count) {
-        throw DatabaseException("Column is out of range");
+    if (!stmt) {
+        prepare();
     }
-    return sqlite3_column_int(stmt, col_idx++);
+    const int res = sqlite3_bind_int64(stmt, ++bind_idx, value);
+    if (res == SQLITE_OK) {
+        record_binding(SQLITE_INTEGER, &value, sizeof(value));
+    }
+    return DatabaseStatus(res, database->db);
 }
 
-uint32_t Query::get_uint32() MAYTHROW
+DatabaseStatus Query::try_bind(uint64_t value) MAYTHROW
 {
-    const auto value = get_int64();
-    if (value < 0 || value > std::numeric_limits<uint32_t>::max()) {
-        throw DatabaseException("uint32 value is out of range");
+    if (value > static_cast<uint64_t>(std::numeric_limits<int64_t>::max())) {
+        if (!stmt) {
+            prepare();
+        }
+        // skips the parameter like a failed sqlite bind does
+        ++bind_idx;
+        return DatabaseStatus(SQLITE_MISMATCH);
     }
-    return value;
+    return try_bind(static_cast<int64_t>(value));
 }
 
-int64_t Query::get_int64() MAYTHROW
+DatabaseStatus Query::try_bind(double value) MAYTHROW
 {
-    if (col_idx >= col_count) {
-        throw DatabaseException("Column is out of range");
+    if (!stmt) {
+        prepare();
     }
-    return sqlite3_column_int64(stmt, col_idx++);
+    const int res = sqlite3_bind_double(stmt, ++bind_idx, value);
+    if (res == SQLITE_OK) {
+        // the bit pattern, the expanded sql rounds to 15 digits
+        record_binding(SQLITE_FLOAT, &value, sizeof(value));
+    }
+    return DatabaseStatus(res, database->db);
 }
 
-uint64_t Query::get_uint64() MAYTHROW
+DatabaseStatus Query::try_bind(BlobView blob, bool constant) MAYTHROW
 {
-    const auto value = get_int64();
-    if (value < 0) {
-        throw DatabaseException("uint64 value is out of range");
+    if (!stmt) {
+        prepare();
     }
-    return value;
+    // A null pointer would bind NULL instead of an empty blob
+    static const uint8_t empty = 0;
+    const int res = sqlite3_bind_blob64(stmt, ++bind_idx, blob.data() ? blob.data() : &empty, blob.size(),
+                                        constant ? SQLITE_STATIC : SQLITE_TRANSIENT);
+    if (res == SQLITE_OK) {
+        record_binding(SQLITE_BLOB, blob.data(), blob.size());
+    }
+    return DatabaseStatus(res, database->db);
 }
 
-double Query::get_double() MAYTHROW
+DatabaseStatus Query::try_bind() MAYTHROW
 {
-    if (col_idx >= col_count) {
+    if (!stmt) {
+        prepare();
+    }
+    const int res = sqlite3_bind_null(stmt, ++bind_idx);
+    if (res == SQLITE_OK) {
+        record_binding(SQLITE_NULL, nullptr, 0);
+    }
+    return DatabaseStatus(res, database->db);
+}
+
+int Query::get_parameter_index(std::string_view name) MAYTHROW
+{
+    // Statements have a few parameters, a linear search is faster than hashing
+    for (const auto &[parameter, idx] : parameter_indexes) {
+        if (parameter == name) {
+            return idx;
+        }
+    }
+    if (!stmt) {
+        prepare();
+    }
+    const std::string parameter(name);
+    const int idx = sqlite3_bind_parameter_index(stmt, parameter.c_str());
+    if (!idx) {
+        throw DatabaseException("Unknown parameter name");
+    }
+    parameter_indexes.emplace_back(parameter, idx);
+    return idx;
+}
+
+Query &Query::bind_int64_array(const int64_t *data, size_t size, bool constant) MAYTHROW
+{
+    if (!stmt) {
+        prepare();
+    }
+    // A null pointer would bind NULL instead of an empty blob
+    static const uint8_t empty = 0;
+    const auto bytes = size * sizeof(int64_t);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const int res = sqlite3_bind_blob64(stmt, ++bind_idx, size ? static_cast<const void *>(data) : &empty, bytes, constant ? SQLITE_STATIC : SQLITE_TRANSIENT);
+#else
+    std::vector<uint8_t> buffer(bytes);
+    auto ptr = buffer.data();
+    for (size_t i = 0; i < size; ++i) {
+        const auto value = static_cast<uint64_t>(data[i]);
+        for (size_t j = 0; j < sizeof(int64_t); ++j) {
+            *ptr++ = static_cast<uint8_t>(value >> (j * 8));
+        }
+    }
+    const int res = sqlite3_bind_blob64(stmt, ++bind_idx, size ? buffer.data() : &empty, bytes, SQLITE_TRANSIENT);
+#endif
+    if (res != SQLITE_OK) {
+        throw DatabaseException(database->db);
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    record_binding(SQLITE_BLOB, data, bytes);
+#else
+    record_binding(SQLITE_BLOB, buffer.data(), bytes);
+#endif
+    return *this;
+}
+
+Query &Query::bind_int64_array(const std::vector<int64_t> &array, bool constant) MAYTHROW
+{
+    return bind_int64_array(array.data(), array.size(), constant);
+}
+
+bool Query::step() MAYTHROW
+{
+    const auto status = try_step();
+    if (status.has_row()) {
+        return true;
+    }
+    if (status.is_done()) {
+        return false;
+    }
+    throw DatabaseException(status);
+}
+
+DatabaseStatus Query::try_step() MAYTHROW
+{
+    if (!stmt) {
+        prepare();
+    }
+    if (arena) {
+        arena->reset();
+    }
+    col_idx = 0;
+    // A statement that hasn't returned rows yet can be restarted without side effects if it's read-only
+    const bool restartable = !sqlite3_stmt_busy(stmt);
+    const auto timeouts = database->lock_wait_stats.timeouts;
+    int res = execute_step();
+    // Retrying is pointless once the busy handler has given up at the deadline
+    const auto retryable = [this, timeouts](int res) {
+        return ((res & 0xff) == SQLITE_BUSY || (res & 0xff) == SQLITE_LOCKED) && database->lock_wait_stats.timeouts == timeouts;
+    };
+    if (retryable(res) && restartable && database->busy_strategy &&
+        database->busy_strategy->retry_reads && sqlite3_stmt_readonly(stmt)) {
+        const auto start = std::chrono::steady_clock::now();
+        for (int attempt = 0; retryable(res) && database->busy_wait(attempt, start); ++attempt) {
+            ++database->lock_wait_stats.step_retries;
+            sqlite3_reset(stmt);
+            res = execute_step();
+        }
+    }
+    switch (res) {
+    case SQLITE_ROW:
+        done = false;
+        return DatabaseStatus(res);
+    case SQLITE_DONE:
+        done = true;
+        return DatabaseStatus(res);
+    default:
+        return DatabaseStatus(sqlite3_extended_errcode(database->db), database->db);
+    }
+}
+
+int Query::execute_step() noexcept
+{
+    if (!profile && !slow_log) {
+        return sqlite3_step(stmt);
+    }
+    const auto start = std::chrono::steady_clock::now();
+    const int res = sqlite3_step(stmt);
+    const auto ns = QueryProfiler::elapsed_ns(start);
+    if (profile) {
+        ++profile->step_count;
+        profile->step_ns += ns;
+        QueryProfiler::add_latency(profile->step_histogram, ns);
+        if (res == SQLITE_ROW) {
+            ++profile->rows;
+        }
+    }
+    if (slow_log) {
+        // at least 1, so that a started run is always reported
+        run_ns += std::max<uint64_t>(ns, 1);
+        if (res != SQLITE_ROW) {
+            finish_run();
+        }
+    }
+    return res;
+}
+
+void Query::finish_run() noexcept
+{
+    const auto ns = run_ns;
+    run_ns = 0;
+    try {
+        slow_log->report(database->db, stmt, sql.view(), ns);
+    } catch (...) {
+    }
+}
+
+Query &Query::step(Query &query) MAYTHROW
+{
+    query.step();
+    return query;
+}
+
+
+
+Query &Query::rerun() noexcept
+{
+    if (run_ns) {
+        finish_run();
+    }
+    if (stmt) {
+        sqlite3_reset(stmt);
+    }
+    col_idx = 0;
+    done = false;
+    return *this;
+}
+
+Query &Query::reset() noexcept
+{
+    release();
+    parameter_indexes.clear();
+    sql.clear();
+    bind_idx = 0;
+    col_idx = 0;
+    col_count = 0;
+    done = false;
+    return *this;
+}
+
+Query &Query::clear_bindings() noexcept
+{
+    if (stmt) {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+    owned_values.clear();
+    bound_values.clear();
+    untracked_bindings = false;
+    bind_idx = 0;
+    col_idx = 0;
+    done = false;
+    return *this;
+}
+
+bool Query::is_null() const noexcept
+{
+    return sqlite3_column_type(stmt, col_idx) == SQLITE_NULL;
+}
+
+Query &Query::skip() MAYTHROW
+{
+    if (col_idx >= col_count) {
+        throw DatabaseException("Column is out of range");
+    }
+    ++col_idx;
+    return *this;
+}
+
+std::string Query::get_string() MAYTHROW
+{
+    if (col_idx >= col_count) {
+        throw DatabaseException("Column is out of range");
+    }
+    return column_string(col_idx++);
+}
+
+std::pmr::string Query::get_string(std::pmr::memory_resource *resource) MAYTHROW
+{
+    if (col_idx >= col_count) {
+        throw DatabaseException("Column is out of range");
+    }
+    return std::pmr::string(column_string_view(col_idx++), resource);
+}
+
+std::string_view Query::get_string_view() MAYTHROW
+{
+    if (col_idx >= col_count) {
+        throw DatabaseException("Column is out of range");
+    }
+    return column_string_view(col_idx++);
+}
+
+BlobView Query::get_blob() MAYTHROW
+{
+    if (col_idx >= col_count) {
+        throw DatabaseException("Column is out of range");
+    }
+    return column_blob(col_idx++);
+}
+
+int32_t Query::get_int32() MAYTHROW
+{
+    if (col_idx >= col_count) {
+        throw DatabaseException("Column is out of range");
+    }
+    return sqlite3_column_int(stmt, col_idx++);
+}
+
+uint32_t Query::get_uint32() MAYTHROW
+{
+    const auto value = get_int64();
+    if (value < 0 || value > std::numeric_limits<uint32_t>::max()) {
+        throw DatabaseException("uint32 value is out of range");
+    }
+    return value;
+}
+
+int64_t Query::get_int64() MAYTHROW
+{
+    if (col_idx >= col_count) {
+        throw DatabaseException("Column is out of range");
+    }
+    return sqlite3_column_int64(stmt, col_idx++);
+}
+
+uint64_t Query::get_uint64() MAYTHROW
+{
+    const auto value = get_int64();
+    if (value < 0) {
+        throw DatabaseException("uint64 value is out of range");
+    }
+    return value;
+}
+
+double Query::get_double() MAYTHROW
+{
+    if (col_idx >= col_count) {
+        throw DatabaseException("Column is out of range");
+    }
+    return sqlite3_column_double(stmt, col_idx++);
+}
+
+std::vector<int64_t> Query::get_int64_array(char delimiter) MAYTHROW
+{
+    std::vector<int64_t> result;
+    read_int64_array(result, delimiter);
+    return result;
+}
+
+std::pmr::vector<int64_t> Query::get_int64_array(std::pmr::memory_resource *resource, char delimiter) MAYTHROW
+{
+    std::pmr::vector<int64_t> result(resource);
+    read_int64_array(result, delimiter);
+    return result;
+}
+
+template<typename Vector>
+void Query::read_int64_array(Vector &result, char delimiter) MAYTHROW
+{
+    if (col_idx >= col_count) {
+        throw DatabaseException("Column is out of range");
+    }
+    const auto idx = col_idx++;
+    if (sqlite3_column_type(stmt, idx) == SQLITE_BLOB) {
+        const auto blob = column_blob(idx);
+        if (blob.size() % sizeof(int64_t)) {
+            throw DatabaseException("Invalid int64 array blob size");
+        }
+        result.resize(blob.size() / sizeof(int64_t));
+        if (result.empty()) {
+            return;
+        }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        memcpy(result.data(), blob.data(), blob.size());
+#else
+        auto ptr = blob.data();
+        for (auto &value : result) {
+            uint64_t tmp = 0;
+            for (size_t i = 0; i < sizeof(int64_t); ++i) {
+                tmp |= static_cast<uint64_t>(*ptr++) << (i * 8);
+            }
+            value = static_cast<int64_t>(tmp);
+        }
+#endif
+        return;
+    }
+    const auto str = column_string_view(idx);
+    auto ptr = str.data();
+    const auto end = ptr + str.size();
+    result.reserve(std::count(ptr, end, delimiter) + 1);
+    while (ptr != end) {
+        while (ptr != end && isspace(static_cast<unsigned char>(*ptr))) {
+            ++ptr;
+        }
+        if (ptr != end && *ptr == '+') {
+            ++ptr;
+        }
+        int64_t value;
+        const auto res = std::from_chars(ptr, end, value);
+        if (res.ec != std::errc()) {
+            throw DatabaseException("Invalid int64 array value");
+        }
+        result.push_back(value);
+        ptr = res.ptr;
+        while (ptr != end && *ptr != delimiter) {
+            if (!isspace(static_cast<unsigned char>(*ptr++))) {
+                throw DatabaseException("Invalid int64 array value");
+            }
+        }
+        if (ptr != end) {
+            ++ptr;
+        }
+    }
+}
+
+std::shared_ptr<const CachedResult> Query::fetch_cached() MAYTHROW
+{
+    if (!stmt) {
+        prepare();
+    }
+    auto cache = database->result_cache.get();
+    std::string key;
+    const std::vector<std::string> *tables = nullptr;
+    // The key is the sql text and the exact bound values, each length-prefixed with its type and raw bytes
+    if (cache && !untracked_bindings && sqlite3_stmt_readonly(stmt)) {
+        key = sqlite3_sql(stmt);
+        key += '\0';
+        for (const auto &value : bound_values) {
+            const auto size = static_cast<uint32_t>(value.size());
+            key.append(reinterpret_cast<const char *>(&size), sizeof(size));
+            key += value;
+        }
+        if (auto result = cache->find(key)) {
+            return result;
+        }
+        tables = cache->get_tables(sqlite3_sql(stmt));
+    }
+    auto result = std::make_shared<CachedResult>();
+    result->columns = static_cast<size_t>(col_count);
+    while (step()) {
+        result->add_row(stmt);
+    }
+    if (tables) {
+        cache->insert(std::move(key), *tables, result);
+    }
+    return result;
+}
+
+size_t Query::fetch_batch(ColumnBatch &batch, size_t n) MAYTHROW
+{
+    batch.clear();
+    // sqlite restarts a finished statement on the next step
+    if (done) {
+        return 0;
+    }
+    if (!stmt) {
+        prepare();
+    }
+    batch.columns.resize(col_count);
+    for (auto &column : batch.columns) {
+        column.nulls.reserve((n + 63) / 64);
+    }
+    while (batch.rows < n && !done && step()) {
+        const auto row = batch.rows++;
+        for (int idx = 0; idx < col_count; ++idx) {
+            auto &column = batch.columns[idx];
+            if (row % 64 == 0) {
+                column.nulls.push_back(0);
+            }
+            const auto type = sqlite3_column_type(stmt, idx);
+            if (type == SQLITE_NULL) {
+                column.nulls.back() |= uint64_t(1) << (row % 64);
+            }
+            else if (column.column_type == ColumnBatch::Null) {
+                column.set_type(static_cast<ColumnBatch::Type>(type), row);
+            }
+            switch (column.column_type) {
+            case ColumnBatch::Integer:
+                column.integer_values.push_back(sqlite3_column_int64(stmt, idx));
+                break;
+            case ColumnBatch::Float:
+                column.real_values.push_back(sqlite3_column_double(stmt, idx));
+                break;
+            case ColumnBatch::Text: {
+                const auto value = column_string_view(idx);
+                column.data.insert(column.data.end(), value.begin(), value.end());
+                column.offsets.push_back(column.data.size());
+                break;
+            }
+            case ColumnBatch::Blob: {
+                const auto value = column_blob(idx);
+                column.data.insert(column.data.end(), value.begin(), value.end());
+                column.offsets.push_back(column.data.size());
+                break;
+            }
+            default:
+                break;
+            }
+        }
+    }
+    if (batch.empty()) {
+        batch.columns.clear();
+    }
+    for (auto &column : batch.columns) {
+        column.set_type(column.column_type == ColumnBatch::Null ? ColumnBatch::Integer : column.column_type, batch.rows);
+    }
+    return batch.rows;
+}
+
+ColumnBatch Query::fetch_batch(size_t n) MAYTHROW
+{
+    ColumnBatch batch;
+    fetch_batch(batch, n);
+    return batch;
+}
+
+MonotonicArena *Query::get_arena()
+{
+    if (!arena) {
+        arena = std::make_unique<MonotonicArena>();
+    }
+    return arena.get();
+}
+
+QueryPlan Query::explain_plan() const MAYTHROW
+{
+    return explain_query_plan(database->db, sql.view());
+}
+
+std::shared_ptr<SqliteDatabase> Query::get_database() const noexcept
+{
+    return database;
+}
+
+void Query::check_column_count(size_t count) MAYTHROW
+{
+    if (static_cast<size_t>(col_count) < count) {
         throw DatabaseException("Column is out of range");
     }
-    return sqlite3_column_double(stmt, col_idx++);
 }
 
-std::vector<int64_t> Query::get_int64_array(char delimiter) MAYTHROW
+bool Query::column_is_null(int idx) const noexcept
+{
+    return sqlite3_column_type(stmt, idx) == SQLITE_NULL;
+}
+
+int64_t Query::column_int64(int idx) const noexcept
+{
+    return sqlite3_column_int64(stmt, idx);
+}
+
+double Query::column_double(int idx) const noexcept
+{
+    return sqlite3_column_double(stmt, idx);
+}
+
+std::string Query::column_string(int idx) const
+{
+    return std::string(column_string_view(idx));
+}
+
+std::string_view Query::column_string_view(int idx) const noexcept
+{
+    // sqlite3_column_bytes must be called after sqlite3_column_text, the text conversion may change the size
+    auto str = reinterpret_cast<const char *>(sqlite3_column_text(stmt, idx));
+    return str ? std::string_view(str, sqlite3_column_bytes(stmt, idx)) : std::string_view();
+}
+
+BlobView Query::column_blob(int idx) const noexcept
+{
+    auto data = sqlite3_column_blob(stmt, idx);
+    return data ? BlobView(data, sqlite3_column_bytes(stmt, idx)) : BlobView();
+}
+
+
+
+void ColumnBatch::Column::clear() noexcept
+{
+    column_type = Null;
+    nulls.clear();
+    integer_values.clear();
+    real_values.clear();
+    offsets.clear();
+    data.clear();
+}
+
+void ColumnBatch::Column::set_type(Type type, size_t rows)
+{
+    // Fills the values of the leading NULL rows with defaults
+    column_type = type;
+    switch (type) {
+    case Integer:
+        integer_values.resize(rows);
+        break;
+    case Float:
+        real_values.resize(rows);
+        break;
+    default:
+        offsets.resize(rows + 1, 0);
+        break;
+    }
+}
+
+void ColumnBatch::clear() noexcept
+{
+    for (auto &column : columns) {
+        column.clear();
+    }
+    rows = 0;
+}
+
+
+
+Transaction::Transaction(std::shared_ptr<SqliteDatabase> database) MAYTHROW :
+    database(std::move(database)), exception_count(std::uncaught_exceptions())
+{
+    this->database->begin_transaction_level(*this);
+}
+
+Transaction::~Transaction() MAYTHROW
+{
+    if (!database) {
+        return;
+    }
+    if (exception_count == std::uncaught_exceptions()) {
+        commit();
+        return;
+    }
+    // Called during stack unwinding. Rollback and don't throw
+    try {
+        rollback();
+    } catch (const std::exception &e) {
+        std::cerr << "Transaction rollback error: " << e.what() << std::endl;
+    }
+}
+
+void Transaction::commit() MAYTHROW
+{
+    if (!database) {
+        throw DatabaseException("Can't commit on inactive transaction");
+    }
+    database->commit_transaction_level(*this);
+    // The transaction is closed before the changes are captured, a failing sink can't roll back the commit
+    const auto db = std::move(database);
+#ifdef SQLITE_DATABASE_ENABLE_SESSION
+    if (db->change_capture && !savepoint) {
+        db->change_capture->flush();
+    }
+#endif
+}
+
+void Transaction::rollback() MAYTHROW
+{
+    if (!database) {
+        throw DatabaseException("Can't rollback on inactive transaction");
+    }
+    // The transaction level is released even if the rollback fails
+    const auto db = std::move(database);
+    db->rollback_transaction_level(*this);
+}
+
+
+
+BulkInserter::BulkInserter(std::shared_ptr<SqliteDatabase> database, const std::string &table,
+                           const std::vector<std::string> &columns, size_t batch_rows, size_t commit_rows) MAYTHROW :
+    database(std::move(database)),
+    exception_count(std::uncaught_exceptions()),
+    column_count(columns.size()),
+    commit_rows(commit_rows)
+{
+    if (columns.empty()) {
+        throw DatabaseException("Bulk insert requires at least one column");
+    }
+    const size_t max_variables = sqlite3_limit(this->database->db, SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+    this->batch_rows = std::max<size_t>(1, std::min(batch_rows, max_variables / column_count));
+
+    row_sql = "(?";
+    for (size_t i = 1; i < column_count; ++i) {
+        row_sql += ",?";
+    }
+    row_sql += ')';
+    insert_sql = "INSERT INTO " + table + " (";
+    for (size_t i = 0; i < column_count; ++i) {
+        if (i) {
+            insert_sql += ',';
+        }
+        insert_sql += columns[i];
+    }
+    insert_sql += ") VALUES ";
+    batch_sql = make_sql(this->batch_rows);
+    values.resize(this->batch_rows * column_count);
+}
+
+BulkInserter::~BulkInserter() MAYTHROW
+{
+    struct Guard
+    {
+        BulkInserter *self;
+        ~Guard()
+        {
+            if (self->batch_stmt) {
+                self->database->release_statement(self->batch_sql, self->batch_stmt);
+            }
+        }
+    } guard{this};
+    // Called during stack unwinding. Pending rows are dropped and the transaction is rolled back
+    if (exception_count == std::uncaught_exceptions()) {
+        flush();
+    }
+}
+
+void BulkInserter::flush() MAYTHROW
+{
+    if (pending_rows) {
+        // The remainder goes in one statement sized to it. It's finalized right away,
+        // caching a one-off statement would push the hot ones out of the statement cache
+        const auto sql = make_sql(pending_rows);
+        sqlite3_stmt *stmt = nullptr;
+        if (sqlite3_prepare_v2(database->db, sql.c_str(), sql.size(), &stmt, nullptr) != SQLITE_OK) {
+            throw DatabaseException(database->db);
+        }
+        const auto rows = pending_rows;
+        pending_rows = 0;
+        try {
+            execute(stmt, rows);
+        } catch (...) {
+            sqlite3_finalize(stmt);
+            throw;
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (transaction) {
+        transaction->commit();
+        transaction.reset();
+        uncommitted_rows = 0;
+    }
+}
+
+size_t BulkInserter::get_batch_rows() const noexcept
+{
+    return batch_rows;
+}
+
+uint64_t BulkInserter::get_row_count() const noexcept
+{
+    return row_count;
+}
+
+std::string BulkInserter::make_sql(size_t rows) const
+{
+    std::string sql;
+    sql.reserve(insert_sql.size() + (row_sql.size() + 1) * rows);
+    sql = insert_sql;
+    for (size_t i = 0; i < rows; ++i) {
+        if (i) {
+            sql += ',';
+        }
+        sql += row_sql;
+    }
+    return sql;
+}
+
+BulkInserter::Value &BulkInserter::next_value() MAYTHROW
+{
+    if (value_idx >= column_count) {
+        value_idx = 0;
+        throw DatabaseException("Value count doesn't match the column count");
+    }
+    return values[pending_rows * column_count + value_idx++];
+}
+
+void BulkInserter::set_null() MAYTHROW
+{
+    next_value().type = SQLITE_NULL;
+}
+
+void BulkInserter::set_int64(int64_t value) MAYTHROW
+{
+    auto &v = next_value();
+    v.type = SQLITE_INTEGER;
+    v.integer = value;
+}
+
+void BulkInserter::set_uint64(uint64_t value) MAYTHROW
+{
+    if (value > std::numeric_limits<int64_t>::max()) {
+        throw DatabaseException("Can't bind value. Sqlite doesn't support uint64 type");
+    }
+    set_int64(static_cast<int64_t>(value));
+}
+
+void BulkInserter::set_double(double value) MAYTHROW
+{
+    auto &v = next_value();
+    v.type = SQLITE_FLOAT;
+    v.real = value;
+}
+
+void BulkInserter::set_text(std::string_view value) MAYTHROW
+{
+    auto &v = next_value();
+    v.type = SQLITE_TEXT;
+    v.text.assign(value.data(), value.size());
+}
+
+void BulkInserter::next_row() MAYTHROW
+{
+    if (value_idx != column_count) {
+        value_idx = 0;
+        throw DatabaseException("Value count doesn't match the column count");
+    }
+    value_idx = 0;
+    if (++pending_rows < batch_rows) {
+        return;
+    }
+    if (!batch_stmt) {
+        batch_stmt = database->acquire_statement(batch_sql);
+    }
+    pending_rows = 0;
+    execute(batch_stmt, batch_rows);
+}
+
+void BulkInserter::execute(sqlite3_stmt *stmt, size_t rows) MAYTHROW
+{
+    if (commit_rows && !transaction) {
+        transaction.reset(new Transaction(database->begin_transaction()));
+    }
+    auto db = database->db;
+    auto value = values.data();
+    const int count = rows * column_count;
+    // Values are kept alive until they are rebound, so the text doesn't have to be copied by sqlite
+    for (int i = 1; i <= count; ++i, ++value) {
+        int res;
+        switch (value->type) {
+        case SQLITE_INTEGER:
+            res = sqlite3_bind_int64(stmt, i, value->integer);
+            break;
+        case SQLITE_FLOAT:
+            res = sqlite3_bind_double(stmt, i, value->real);
+            break;
+        case SQLITE_TEXT:
+            res = sqlite3_bind_text(stmt, i, value->text.data(), value->text.size(), SQLITE_STATIC);
+            break;
+        default:
+            res = sqlite3_bind_null(stmt, i);
+            break;
+        }
+        if (res != SQLITE_OK) {
+            throw DatabaseException(db);
+        }
+    }
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        DatabaseException e(db);
+        sqlite3_reset(stmt);
+        throw e;
+    }
+    sqlite3_reset(stmt);
+    row_count += rows;
+    commit_if_needed(rows);
+}
+
+void BulkInserter::commit_if_needed(size_t rows) MAYTHROW
+{
+    if (!transaction || (uncommitted_rows += rows) < commit_rows) {
+        return;
+    }
+    transaction->commit();
+    transaction.reset();
+    uncommitted_rows = 0;
+}
+
+
+
+SqliteDatabase::SqliteDatabase(sqlite3 *db) noexcept :
+    db(db)
+{
+
+}
+
+SqliteDatabase::~SqliteDatabase()
+{
+    result_cache.reset();
+    finalize_control_statements();
+    shrink_statement_cache(0);
+    sqlite3_close(db);
+}
+
+std::shared_ptr<SqliteDatabase> SqliteDatabase::open(const std::string &filename) MAYTHROW
+{
+    sqlite3 *db;
+    if (sqlite3_open(filename.c_str(), &db) != SQLITE_OK) {
+        throw DatabaseException(db);
+    }
+    return std::make_shared<SqliteDatabase>(db);
+}
+
+std::shared_ptr<SqliteDatabase> SqliteDatabase::open(const std::string &filename, const OpenOptions &options) MAYTHROW
+{
+    int flags = options.read_only ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE;
+    if (options.create && !options.read_only) {
+        flags |= SQLITE_OPEN_CREATE;
+    }
+    if (options.no_mutex) {
+        flags |= SQLITE_OPEN_NOMUTEX;
+    }
+    if (options.uri) {
+        flags |= SQLITE_OPEN_URI;
+    }
+    sqlite3 *db;
+    if (sqlite3_open_v2(filename.c_str(), &db, flags, nullptr) != SQLITE_OK) {
+        DatabaseException e(db);
+        sqlite3_close(db);
+        throw e;
+    }
+    // The connection is closed if any of the settings fails
+    auto database = std::make_shared<SqliteDatabase>(db);
+    const auto pragma = [&database](const char *name, const std::string &value) {
+        database->exec(("PRAGMA " + std::string(name) + '=' + value).c_str());
+    };
+    // page_size has to be set before the journal mode is switched to WAL
+    if (options.page_size) {
+        pragma("page_size", std::to_string(*options.page_size));
+    }
+    if (!options.journal_mode.empty()) {
+        pragma("journal_mode", options.journal_mode);
+    }
+    if (!options.synchronous.empty()) {
+        pragma("synchronous", options.synchronous);
+    }
+    if (options.cache_size) {
+        pragma("cache_size", std::to_string(*options.cache_size));
+    }
+    if (options.mmap_size) {
+        pragma("mmap_size", std::to_string(*options.mmap_size));
+    }
+    if (!options.temp_store.empty()) {
+        pragma("temp_store", options.temp_store);
+    }
+    if (options.busy_timeout) {
+        sqlite3_busy_timeout(db, *options.busy_timeout);
+    }
+    if (options.busy_strategy) {
+        database->set_busy_strategy(*options.busy_strategy);
+    }
+    return database;
+}
+
+std::shared_ptr<SqliteDatabase> SqliteDatabase::open_read_only(const std::string &filename) MAYTHROW
+{
+    sqlite3 *db;
+    if (sqlite3_open_v2(filename.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+        throw DatabaseException(db);
+    }
+    return std::make_shared<SqliteDatabase>(db);
+}
+
+std::shared_ptr<SqliteDatabase> SqliteDatabase::open_in_memory() MAYTHROW
+{
+    sqlite3 *db;
+    if (sqlite3_open(":memory:", &db) != SQLITE_OK) {
+        throw DatabaseException(db);
+    }
+    return std::make_shared<SqliteDatabase>(db);
+}
+
+
+
+void SqliteDatabase::exec(const char *sql) MAYTHROW
+{
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        throw DatabaseException(db);
+    }
+    const auto res = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (res != SQLITE_ROW && res != SQLITE_DONE) {
+        throw DatabaseException(db);
+    }
+}
+
+sqlite3 *SqliteDatabase::get_handle() const noexcept
+{
+    return db;
+}
+
+Query SqliteDatabase::create_query()
+{
+    return Query(shared_from_this());
+}
+
+Transaction SqliteDatabase::begin_transaction()
+{
+    return Transaction(shared_from_this());
+}
+
+bool SqliteDatabase::in_transaction() const noexcept
+{
+    return !sqlite3_get_autocommit(db);
+}
+
+void SqliteDatabase::set_allocator(const sqlite3_mem_methods &methods) MAYTHROW
+{
+    if (sqlite3_config(SQLITE_CONFIG_MALLOC, &methods) != SQLITE_OK) {
+        throw DatabaseException("Can't change the sqlite allocator after sqlite has been initialized");
+    }
+}
+
+void SqliteDatabase::use_pool_allocator() MAYTHROW
+{
+    set_allocator(pool_allocator_methods());
+}
+
+void SqliteDatabase::backup_to(SqliteDatabase &target, int pages_per_step, std::chrono::milliseconds throttle,
+                               const BackupProgress &progress, const char *schema) MAYTHROW
+{
+    auto backup = sqlite3_backup_init(target.db, "main", db, schema);
+    if (!backup) {
+        throw DatabaseException(target.db);
+    }
+    // Locks held longer than the busy strategy deadline fail the backup
+    const auto deadline = (busy_strategy ? *busy_strategy : BusyStrategy()).deadline;
+    std::optional<std::chrono::steady_clock::time_point> locked_since;
+    int res;
+    do {
+        res = sqlite3_backup_step(backup, pages_per_step);
+        if (progress) {
+            try {
+                progress(sqlite3_backup_remaining(backup), sqlite3_backup_pagecount(backup));
+            } catch (...) {
+                sqlite3_backup_finish(backup);
+                throw;
+            }
+        }
+        if (res == SQLITE_BUSY || res == SQLITE_LOCKED) {
+            const auto now = std::chrono::steady_clock::now();
+            if (!locked_since) {
+                locked_since = now;
+            }
+            else if (now - *locked_since >= deadline) {
+                sqlite3_backup_finish(backup);
+                throw DatabaseException(DatabaseStatus(res));
+            }
+        }
+        else {
+            locked_since.reset();
+        }
+        if (res == SQLITE_OK || res == SQLITE_BUSY || res == SQLITE_LOCKED) {
+            // Let other connections use the source between steps
+            if (throttle.count() > 0) {
+                std::this_thread::sleep_for(throttle);
+            }
+            else if (res != SQLITE_OK) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    } while (res == SQLITE_OK || res == SQLITE_BUSY || res == SQLITE_LOCKED);
+    if (sqlite3_backup_finish(backup) != SQLITE_OK) {
+        throw DatabaseException(target.db);
+    }
+}
+
+void SqliteDatabase::backup_to(const std::string &filename, int pages_per_step, std::chrono::milliseconds throttle,
+                               const BackupProgress &progress, const char *schema) MAYTHROW
+{
+    auto target = open(filename);
+    backup_to(*target, pages_per_step, throttle, progress, schema);
+}
+
+std::future<void> SqliteDatabase::backup_in_background(const std::string &source, const std::string &target, int pages_per_step,
+                                                       std::chrono::milliseconds throttle, BackupProgress progress) MAYTHROW
+{
+    if (!sqlite3_threadsafe()) {
+        throw DatabaseException("Background backup requires sqlite built with SQLITE_DATABASE_THREADSAFE=ON");
+    }
+    return std::async(std::launch::async, [=, progress = std::move(progress)] {
+        OpenOptions options;
+        options.read_only = true;
+        open(source, options)->backup_to(target, pages_per_step, throttle, progress);
+    });
+}
+
+std::vector<uint8_t> SqliteDatabase::serialize(const char *schema) const MAYTHROW
+{
+    sqlite3_int64 size = 0;
+    auto data = sqlite3_serialize(db, schema, &size, 0);
+    if (!data) {
+        // a new database without any pages
+        if (size == 0) {
+            return {};
+        }
+        throw DatabaseException(size > 0 ? "Out of memory" : "Can't serialize the database");
+    }
+    std::vector<uint8_t> result(data, data + size);
+    sqlite3_free(data);
+    return result;
+}
+
+void SqliteDatabase::deserialize(const void *data, size_t size, bool read_only, const char *schema) MAYTHROW
+{
+    auto buffer = static_cast<unsigned char *>(sqlite3_malloc64(size ? size : 1));
+    if (!buffer) {
+        throw DatabaseException("Out of memory");
+    }
+    memcpy(buffer, data, size);
+    const unsigned flags = SQLITE_DESERIALIZE_FREEONCLOSE | (read_only ? SQLITE_DESERIALIZE_READONLY : SQLITE_DESERIALIZE_RESIZEABLE);
+    // sqlite owns the buffer and frees it on close only if the call succeeds
+    if (const int rc = sqlite3_deserialize(db, schema, buffer, size, size, flags); rc != SQLITE_OK) {
+        sqlite3_free(buffer);
+        throw DatabaseException(DatabaseStatus(rc, db));
+    }
+}
+
+BulkInserter SqliteDatabase::create_bulk_inserter(const std::string &table, const std::vector<std::string> &columns,
+                                                  size_t batch_rows, size_t commit_rows) MAYTHROW
+{
+    return BulkInserter(shared_from_this(), table, columns, batch_rows, commit_rows);
+}
+
+
+
+void SqliteDatabase::exec_control(sqlite3_stmt *&stmt, const char *sql) MAYTHROW
+{
+    if (!stmt && sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        throw DatabaseException(db);
+    }
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        DatabaseException e(db);
+        sqlite3_reset(stmt);
+        throw e;
+    }
+    sqlite3_reset(stmt);
+}
+
+void SqliteDatabase::begin_transaction_level(Transaction &transaction) MAYTHROW
+{
+    transaction.level = transaction_depth;
+    transaction.savepoint = transaction_depth || in_transaction();
+    if (!transaction.savepoint) {
+#ifdef SQLITE_DATABASE_ENABLE_SESSION
+        // changes made outside a Transaction get their own changeset
+        if (change_capture) {
+            change_capture->flush();
+        }
+#endif
+        exec_control(begin_stmt, "BEGIN");
+    }
+    else {
+        if (savepoint_stmts.size() <= transaction.level) {
+            savepoint_stmts.resize(transaction.level + 1, {nullptr, nullptr, nullptr});
+        }
+        const auto sql = "SAVEPOINT sqlite_database_" + std::to_string(transaction.level);
+        exec_control(savepoint_stmts[transaction.level][0], sql.c_str());
+    }
+    ++transaction_depth;
+}
+
+void SqliteDatabase::commit_transaction_level(const Transaction &transaction) MAYTHROW
+{
+    if (!transaction.savepoint) {
+        if (profiling) {
+            const auto start = std::chrono::steady_clock::now();
+            exec_control(commit_stmt, "COMMIT");
+            const auto ns = QueryProfiler::elapsed_ns(start);
+            ++profiler->commit_count;
+            profiler->commit_ns += ns;
+            QueryProfiler::add_latency(profiler->commit_histogram, ns);
+        }
+        else {
+            exec_control(commit_stmt, "COMMIT");
+        }
+    }
+    else {
+        const auto sql = "RELEASE sqlite_database_" + std::to_string(transaction.level);
+        exec_control(savepoint_stmts[transaction.level][1], sql.c_str());
+    }
+    --transaction_depth;
+}
+
+void SqliteDatabase::rollback_transaction_level(const Transaction &transaction) MAYTHROW
 {
-    std::vector<int64_t> result;
-    std::stringstream ss(get_string());
-    std::string tmp;
-    while (std::getline(ss, tmp, delimiter)) {
-        result.push_back(std::stoll(tmp));
+    --transaction_depth;
+    if (!transaction.savepoint) {
+        exec_control(rollback_stmt, "ROLLBACK");
+        return;
     }
-    return result;
+    // ROLLBACK TO keeps the savepoint open, it has to be released afterwards
+    const auto name = "sqlite_database_" + std::to_string(transaction.level);
+    auto &stmts = savepoint_stmts[transaction.level];
+    exec_control(stmts[2], ("ROLLBACK TO " + name).c_str());
+    exec_control(stmts[1], ("RELEASE " + name).c_str());
 }
 
-std::shared_ptr<SqliteDatabase> Query::get_database() const noexcept
+void SqliteDatabase::finalize_control_statements() noexcept
 {
-    return database;
+    sqlite3_finalize(begin_stmt);
+    sqlite3_finalize(commit_stmt);
+    sqlite3_finalize(rollback_stmt);
+    for (const auto &stmts : savepoint_stmts) {
+        for (auto stmt : stmts) {
+            sqlite3_finalize(stmt);
+        }
+    }
+    begin_stmt = commit_stmt = rollback_stmt = nullptr;
+    savepoint_stmts.clear();
 }
 
+void SqliteDatabase::set_statement_cache_capacity(size_t capacity) noexcept
+{
+    stmt_cache_capacity = capacity;
+    shrink_statement_cache(capacity);
+}
 
+size_t SqliteDatabase::get_statement_cache_capacity() const noexcept
+{
+    return stmt_cache_capacity;
+}
 
-Transaction::Transaction(std::shared_ptr<SqliteDatabase> database) MAYTHROW :
-    database(std::move(database)), exception_count(std::uncaught_exceptions())
+size_t SqliteDatabase::get_statement_cache_size() const noexcept
 {
-    this->database->exec("BEGIN");
+    return stmt_cache.size();
 }
 
-Transaction::~Transaction() MAYTHROW
+uint64_t SqliteDatabase::get_statement_cache_hits() const noexcept
 {
-    if (!database) {
-        return;
+    return stmt_cache_hits;
+}
+
+uint64_t SqliteDatabase::get_statement_cache_misses() const noexcept
+{
+    return stmt_cache_misses;
+}
+
+void SqliteDatabase::enable_profiling()
+{
+    if (!profiler) {
+        profiler = std::make_unique<QueryProfiler>();
     }
-    if (exception_count == std::uncaught_exceptions()) {
-        database->exec("COMMIT");
-        return;
+    sqlite3_trace_v2(db, SQLITE_TRACE_PROFILE, &QueryProfiler::trace, profiler.get());
+    profiling = true;
+}
+
+void SqliteDatabase::disable_profiling() noexcept
+{
+    sqlite3_trace_v2(db, 0, nullptr, nullptr);
+    profiling = false;
+}
+
+bool SqliteDatabase::is_profiling() const noexcept
+{
+    return profiling;
+}
+
+DatabaseProfile SqliteDatabase::get_profile() const
+{
+    DatabaseProfile result;
+    if (!profiler) {
+        return result;
     }
-    // Called during stack unwinding. Rollback and don't throw
-    try {
-        database->exec("ROLLBACK");
-    } catch (const std::exception &e) {
-        std::cerr << "Transaction rollback error: " << e.what() << std::endl;
+    result.statements.reserve(profiler->statements.size());
+    for (const auto &[sql, entry] : profiler->statements) {
+        result.statements.push_back(entry->profile);
+        result.statements.back().sql = entry->sql;
     }
+    result.commit_count = profiler->commit_count;
+    result.commit_ns = profiler->commit_ns;
+    result.commit_histogram = profiler->commit_histogram;
+    return result;
 }
 
-void Transaction::commit() MAYTHROW
+void SqliteDatabase::reset_profile() noexcept
 {
-    if (!database) {
-        throw DatabaseException("Can't commit on inactive transaction");
+    if (profiler) {
+        profiler->reset();
     }
-    database->exec("COMMIT");
-    database.reset();
 }
 
-void Transaction::rollback() MAYTHROW
+void SqliteDatabase::enable_slow_query_log(SlowQueryOptions options)
 {
-    if (!database) {
-        throw DatabaseException("Can't rollback on inactive transaction");
+    if (!slow_query_log) {
+        slow_query_log = std::make_unique<SlowQueryLog>();
     }
-    database->exec("ROLLBACK");
-    database.reset();
+    slow_query_log->set_options(std::move(options));
+    slow_query_logging = true;
+}
+
+void SqliteDatabase::disable_slow_query_log() noexcept
+{
+    slow_query_logging = false;
 }
 
+void SqliteDatabase::enable_result_cache(size_t max_bytes) MAYTHROW
+{
+    result_cache.reset();
+    result_cache = std::make_unique<ResultCache>(db, max_bytes, registered_functions);
+}
 
+void SqliteDatabase::disable_result_cache() noexcept
+{
+    result_cache.reset();
+}
 
-SqliteDatabase::SqliteDatabase(sqlite3 *db) noexcept :
-    db(db)
+void SqliteDatabase::clear_result_cache() noexcept
 {
+    if (result_cache) {
+        result_cache->clear();
+    }
+}
 
+ResultCacheStats SqliteDatabase::get_result_cache_stats() const noexcept
+{
+    return result_cache ? result_cache->get_stats() : ResultCacheStats();
 }
 
-SqliteDatabase::~SqliteDatabase()
+void SqliteDatabase::set_busy_strategy(const BusyStrategy &strategy) noexcept
 {
-    sqlite3_close(db);
+    busy_strategy = strategy;
+    busy_random = reinterpret_cast<uintptr_t>(this) ^ static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+    sqlite3_busy_handler(db, &SqliteDatabase::busy_handler, this);
 }
 
-std::shared_ptr<SqliteDatabase> SqliteDatabase::open(const std::string &filename) MAYTHROW
+void SqliteDatabase::clear_busy_strategy() noexcept
 {
-    sqlite3 *db;
-    if (sqlite3_open(filename.c_str(), &db) != SQLITE_OK) {
-        throw DatabaseException(db);
+    busy_strategy.reset();
+    sqlite3_busy_handler(db, nullptr, nullptr);
+}
+
+const LockWaitStats &SqliteDatabase::get_lock_wait_stats() const noexcept
+{
+    return lock_wait_stats;
+}
+
+void SqliteDatabase::reset_lock_wait_stats() noexcept
+{
+    lock_wait_stats = LockWaitStats();
+}
+
+int SqliteDatabase::busy_handler(void *context, int count) noexcept
+{
+    auto database = static_cast<SqliteDatabase *>(context);
+    // count restarts from 0 for every lock acquisition
+    if (!count) {
+        database->busy_start = std::chrono::steady_clock::now();
     }
-    return std::make_shared<SqliteDatabase>(db);
+    return database->busy_wait(count, database->busy_start);
 }
 
-std::shared_ptr<SqliteDatabase> SqliteDatabase::open_read_only(const std::string &filename) MAYTHROW
+bool SqliteDatabase::busy_wait(int attempt, std::chrono::steady_clock::time_point start) noexcept
 {
-    sqlite3 *db;
-    if (sqlite3_open_v2(filename.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
-        throw DatabaseException(db);
+    const auto &strategy = *busy_strategy;
+    double delay = static_cast<double>(std::chrono::nanoseconds(strategy.initial_delay).count());
+    const double max_delay = static_cast<double>(std::chrono::nanoseconds(strategy.max_delay).count());
+    for (int i = 0; i < attempt && delay < max_delay; ++i) {
+        delay *= strategy.multiplier;
     }
-    return std::make_shared<SqliteDatabase>(db);
+    delay = std::min(delay, max_delay);
+
+    // xorshift is enough for the jitter
+    busy_random ^= busy_random << 13;
+    busy_random ^= busy_random >> 7;
+    busy_random ^= busy_random << 17;
+    const double random = static_cast<double>(busy_random >> 11) / static_cast<double>(uint64_t(1) << 53);
+    delay *= 1 - std::clamp(strategy.jitter, 0.0, 1.0) * random;
+
+    const auto wait = std::chrono::nanoseconds(static_cast<int64_t>(delay));
+    if (std::chrono::steady_clock::now() + wait - start > strategy.deadline) {
+        ++lock_wait_stats.timeouts;
+        return false;
+    }
+    const auto sleep_start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(wait);
+    ++lock_wait_stats.waits;
+    lock_wait_stats.wait_ns += QueryProfiler::elapsed_ns(sleep_start);
+    return true;
 }
 
-std::shared_ptr<SqliteDatabase> SqliteDatabase::open_in_memory() MAYTHROW
+sqlite3_stmt *SqliteDatabase::acquire_statement(std::string_view sql) MAYTHROW
 {
-    sqlite3 *db;
-    if (sqlite3_open(":memory:", &db) != SQLITE_OK) {
+    // The statement is taken out of the cache while in use,
+    // so two live queries never share the same sqlite3_stmt
+    if (auto it = stmt_cache_index.find(sql); it != stmt_cache_index.end()) {
+        const auto node = it->second;
+        const auto stmt = node->second;
+        stmt_cache_index.erase(it);
+        stmt_cache.erase(node);
+        ++stmt_cache_hits;
+        return stmt;
+    }
+    ++stmt_cache_misses;
+    sqlite3_stmt *stmt;
+    // sql is always backed by a null-terminated buffer, passing the terminator saves sqlite a copy
+    if (sqlite3_prepare_v2(db, sql.data(), sql.size() + 1, &stmt, nullptr) != SQLITE_OK) {
         throw DatabaseException(db);
     }
-    return std::make_shared<SqliteDatabase>(db);
+    return stmt;
+}
+
+void SqliteDatabase::release_statement(std::string_view sql, sqlite3_stmt *stmt) noexcept
+{
+    sqlite3_reset(stmt);
+    if (!stmt_cache_capacity || sql.empty() || stmt_cache_index.count(sql)) {
+        sqlite3_finalize(stmt);
+        return;
+    }
+    sqlite3_clear_bindings(stmt);
+    try {
+        stmt_cache.emplace_front(sql, stmt);
+        try {
+            stmt_cache_index.emplace(stmt_cache.front().first, stmt_cache.begin());
+        } catch (...) {
+            stmt_cache.pop_front();
+            throw;
+        }
+    } catch (...) {
+        sqlite3_finalize(stmt);
+        return;
+    }
+    shrink_statement_cache(stmt_cache_capacity);
 }
 
+void SqliteDatabase::shrink_statement_cache(size_t size) noexcept
+{
+    while (stmt_cache.size() > size) {
+        auto &[sql, stmt] = stmt_cache.back();
+        sqlite3_finalize(stmt);
+        stmt_cache_index.erase(sql);
+        stmt_cache.pop_back();
+    }
+}
 
 
-void SqliteDatabase::exec(const char *sql) MAYTHROW
+
+OpenOptions OpenOptions::bulk_load()
 {
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+    OpenOptions options;
+    options.journal_mode = "WAL";
+    options.synchronous = "OFF";
+    options.cache_size = -256 * 1024;
+    options.temp_store = "MEMORY";
+    return options;
+}
+
+OpenOptions OpenOptions::read_heavy()
+{
+    OpenOptions options;
+    options.journal_mode = "WAL";
+    options.synchronous = "NORMAL";
+    options.cache_size = -64 * 1024;
+    options.mmap_size = 256ll * 1024 * 1024;
+    options.temp_store = "MEMORY";
+    options.busy_timeout = 5000;
+    return options;
+}
+
+OpenOptions OpenOptions::durable()
+{
+    OpenOptions options;
+    options.journal_mode = "WAL";
+    options.synchronous = "FULL";
+    options.busy_timeout = 5000;
+    return options;
+}
+
+
+
+void SqliteDatabase::create_function(const std::string &name, size_t argc, bool deterministic,
+                                     std::unique_ptr<UserFunction> function, bool aggregate) MAYTHROW
+{
+    struct Trampoline
+    {
+        static void call(sqlite3_context *context, int argc, sqlite3_value **argv) noexcept
+        {
+            FunctionContext function_context(context, argc, argv);
+            try {
+                static_cast<UserFunction *>(sqlite3_user_data(context))->call(function_context);
+            } catch (const std::bad_alloc &) {
+                sqlite3_result_error_nomem(context);
+            } catch (const std::exception &e) {
+                function_context.result_error(e.what());
+            }
+        }
+        static void step(sqlite3_context *context, int argc, sqlite3_value **argv) noexcept
+        {
+            FunctionContext function_context(context, argc, argv);
+            try {
+                static_cast<UserFunction *>(sqlite3_user_data(context))->step(function_context);
+            } catch (const std::bad_alloc &) {
+                sqlite3_result_error_nomem(context);
+            } catch (const std::exception &e) {
+                function_context.result_error(e.what());
+            }
+        }
+        static void final(sqlite3_context *context) noexcept
+        {
+            FunctionContext function_context(context, 0, nullptr);
+            try {
+                static_cast<UserFunction *>(sqlite3_user_data(context))->final(function_context);
+            } catch (const std::bad_alloc &) {
+                sqlite3_result_error_nomem(context);
+            } catch (const std::exception &e) {
+                function_context.result_error(e.what());
+            }
+        }
+        static void destroy(void *function) noexcept
+        {
+            delete static_cast<UserFunction *>(function);
+        }
+    };
+
+    int flags = SQLITE_UTF8;
+    if (deterministic) {
+        flags |= SQLITE_DETERMINISTIC;
+    }
+    // sqlite calls destroy even if the registration fails
+    const int rc = sqlite3_create_function_v2(db, name.c_str(), static_cast<int>(argc), flags, function.release(),
+                                              aggregate ? nullptr : &Trampoline::call,
+                                              aggregate ? &Trampoline::step : nullptr,
+                                              aggregate ? &Trampoline::final : nullptr,
+                                              &Trampoline::destroy);
+    if (rc != SQLITE_OK) {
         throw DatabaseException(db);
     }
-    const auto res = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    if (res != SQLITE_ROW && res != SQLITE_DONE) {
+    // A name is deterministic only if all its overloads are
+    std::string key(name);
+    std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c) { return std::tolower(c); });
+    auto [it, inserted] = registered_functions.emplace(std::move(key), deterministic);
+    if (!inserted) {
+        it->second = it->second && deterministic;
+    }
+    if (result_cache) {
+        result_cache->forget_statements();
+    }
+}
+
+
+
+// sqlite3_module callbacks of SqliteDatabase::register_vtab()
+class ContainerModule
+{
+public:
+    // idxNum bits
+    enum Plan {
+        Equal = 1,
+        Lower = 2,
+        LowerInclusive = 4,
+        Upper = 8,
+        UpperInclusive = 16,
+    };
+
+    struct Table : sqlite3_vtab
+    {
+        const VirtualTableSource *source;
+    };
+
+    struct Cursor : sqlite3_vtab_cursor
+    {
+        size_t row;
+        size_t end;
+    };
+
+    static const sqlite3_module &get() noexcept
+    {
+        static const sqlite3_module module = [] {
+            sqlite3_module module = {};
+            module.iVersion = 1;
+            // xCreate is null, so the table is eponymous-only and doesn't need CREATE VIRTUAL TABLE
+            module.xConnect = &ContainerModule::connect;
+            module.xBestIndex = &ContainerModule::best_index;
+            module.xDisconnect = &ContainerModule::disconnect;
+            module.xOpen = &ContainerModule::open;
+            module.xClose = &ContainerModule::close;
+            module.xFilter = &ContainerModule::filter;
+            module.xNext = &ContainerModule::next;
+            module.xEof = &ContainerModule::eof;
+            module.xColumn = &ContainerModule::column;
+            module.xRowid = &ContainerModule::rowid;
+            return module;
+        }();
+        return module;
+    }
+
+    static void destroy(void *source) noexcept
+    {
+        delete static_cast<VirtualTableSource *>(source);
+    }
+
+private:
+    static int connect(sqlite3 *db, void *aux, int, const char *const *, sqlite3_vtab **vtab, char **) noexcept
+    {
+        auto source = static_cast<const VirtualTableSource *>(aux);
+        const int rc = sqlite3_declare_vtab(db, source->schema.c_str());
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+        auto table = new (std::nothrow) Table();
+        if (!table) {
+            return SQLITE_NOMEM;
+        }
+        table->source = source;
+        *vtab = table;
+        return SQLITE_OK;
+    }
+
+    static int disconnect(sqlite3_vtab *vtab) noexcept
+    {
+        delete static_cast<Table *>(vtab);
+        return SQLITE_OK;
+    }
+
+    static int best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) noexcept
+    {
+        auto source = static_cast<Table *>(vtab)->source;
+        int equal = -1;
+        int lower = -1;
+        int upper = -1;
+        for (int i = 0; i < info->nConstraint; ++i) {
+            const auto &constraint = info->aConstraint[i];
+            if (!constraint.usable || constraint.iColumn < 0 || constraint.iColumn != source->key_column) {
+                continue;
+            }
+            // The rows are sorted by the binary comparison
+            if (sqlite3_stricmp(sqlite3_vtab_collation(info, i), "BINARY")) {
+                continue;
+            }
+            switch (constraint.op) {
+            case SQLITE_INDEX_CONSTRAINT_EQ:
+                equal = i;
+                break;
+            case SQLITE_INDEX_CONSTRAINT_GT:
+            case SQLITE_INDEX_CONSTRAINT_GE:
+                lower = i;
+                break;
+            case SQLITE_INDEX_CONSTRAINT_LT:
+            case SQLITE_INDEX_CONSTRAINT_LE:
+                upper = i;
+                break;
+            }
+        }
+
+        // The constraints aren't omitted: the binary search only narrows the scan and sqlite rechecks the rows
+        const auto rows = static_cast<double>(source->size());
+        int argc = 0;
+        info->idxNum = 0;
+        if (equal >= 0) {
+            info->idxNum = Equal;
+            info->aConstraintUsage[equal].argvIndex = ++argc;
+            info->estimatedRows = 1;
+        }
+        else {
+            if (lower >= 0) {
+                info->idxNum |= info->aConstraint[lower].op == SQLITE_INDEX_CONSTRAINT_GE ? LowerInclusive : Lower;
+                info->aConstraintUsage[lower].argvIndex = ++argc;
+            }
+            if (upper >= 0) {
+                info->idxNum |= info->aConstraint[upper].op == SQLITE_INDEX_CONSTRAINT_LE ? UpperInclusive : Upper;
+                info->aConstraintUsage[upper].argvIndex = ++argc;
+            }
+            info->estimatedRows = static_cast<sqlite3_int64>(argc ? rows / (argc * 4) + 1 : rows);
+        }
+        info->estimatedCost = argc ? std::log2(rows + 1) + static_cast<double>(info->estimatedRows) : rows;
+
+        // Rows are returned in the key order
+        if (source->key_column >= 0 && info->nOrderBy == 1 &&
+            info->aOrderBy[0].iColumn == source->key_column && !info->aOrderBy[0].desc) {
+            info->orderByConsumed = 1;
+        }
+        return SQLITE_OK;
+    }
+
+    static int open(sqlite3_vtab *, sqlite3_vtab_cursor **cursor) noexcept
+    {
+        auto result = new (std::nothrow) Cursor();
+        if (!result) {
+            return SQLITE_NOMEM;
+        }
+        *cursor = result;
+        return SQLITE_OK;
+    }
+
+    static int close(sqlite3_vtab_cursor *cursor) noexcept
+    {
+        delete static_cast<Cursor *>(cursor);
+        return SQLITE_OK;
+    }
+
+    static int filter(sqlite3_vtab_cursor *vtab_cursor, int plan, const char *, int argc, sqlite3_value **argv) noexcept
+    {
+        auto cursor = static_cast<Cursor *>(vtab_cursor);
+        auto source = static_cast<Table *>(cursor->pVtab)->source;
+        cursor->row = 0;
+        cursor->end = source->size();
+        for (int i = 0; i < argc; ++i) {
+            if (sqlite3_value_type(argv[i]) == SQLITE_NULL) {
+                // Comparisons with NULL are never true
+                cursor->end = 0;
+                return SQLITE_OK;
+            }
+        }
+        // Values of another storage class don't compare by the key order, e.g. text with an integer key.
+        // Such a bound isn't narrowed and sqlite checks it on every row
+        const auto searchable = [source, argv](int idx) {
+            const int type = sqlite3_value_type(argv[idx]);
+            return source->text_key ? type == SQLITE_TEXT : type == SQLITE_INTEGER || type == SQLITE_FLOAT;
+        };
+        const FunctionContext arguments(nullptr, argc, argv);
+        try {
+            int idx = 0;
+            if (plan & Equal) {
+                if (searchable(idx)) {
+                    cursor->row = source->partition_point(arguments, idx, false);
+                    cursor->end = source->partition_point(arguments, idx, true);
+                }
+                return SQLITE_OK;
+            }
+            if (plan & (Lower | LowerInclusive)) {
+                if (searchable(idx)) {
+                    cursor->row = source->partition_point(arguments, idx, (plan & Lower) != 0);
+                }
+                ++idx;
+            }
+            if ((plan & (Upper | UpperInclusive)) && searchable(idx)) {
+                cursor->end = std::max(cursor->row, source->partition_point(arguments, idx, (plan & UpperInclusive) != 0));
+            }
+        } catch (const std::bad_alloc &) {
+            return SQLITE_NOMEM;
+        } catch (const std::exception &e) {
+            sqlite3_free(cursor->pVtab->zErrMsg);
+            cursor->pVtab->zErrMsg = sqlite3_mprintf("%s", e.what());
+            return SQLITE_ERROR;
+        }
+        return SQLITE_OK;
+    }
+
+    static int next(sqlite3_vtab_cursor *cursor) noexcept
+    {
+        ++static_cast<Cursor *>(cursor)->row;
+        return SQLITE_OK;
+    }
+
+    static int eof(sqlite3_vtab_cursor *vtab_cursor) noexcept
+    {
+        auto cursor = static_cast<Cursor *>(vtab_cursor);
+        return cursor->row >= cursor->end;
+    }
+
+    static int column(sqlite3_vtab_cursor *vtab_cursor, sqlite3_context *context, int idx) noexcept
+    {
+        auto cursor = static_cast<Cursor *>(vtab_cursor);
+        FunctionContext function_context(context, 0, nullptr);
+        try {
+            static_cast<Table *>(cursor->pVtab)->source->column(cursor->row, idx, function_context);
+        } catch (const std::bad_alloc &) {
+            return SQLITE_NOMEM;
+        } catch (const std::exception &e) {
+            function_context.result_error(e.what());
+            return SQLITE_ERROR;
+        }
+        return SQLITE_OK;
+    }
+
+    static int rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) noexcept
+    {
+        *rowid = static_cast<sqlite3_int64>(static_cast<Cursor *>(cursor)->row);
+        return SQLITE_OK;
+    }
+};
+
+void SqliteDatabase::create_module(const std::string &name, std::unique_ptr<VirtualTableSource> source, bool sorted) MAYTHROW
+{
+    if (sorted && source->key_column < 0) {
+        throw DatabaseException("Sorted key has to be an arithmetic or string field");
+    }
+    // sqlite calls destroy even if the registration fails
+    if (sqlite3_create_module_v2(db, name.c_str(), &ContainerModule::get(), source.release(), &ContainerModule::destroy) != SQLITE_OK) {
         throw DatabaseException(db);
     }
 }
 
-Query SqliteDatabase::create_query()
+
+FunctionContext::FunctionContext(sqlite3_context *context, int argc, sqlite3_value **argv) noexcept :
+    context(context), argc(argc), argv(argv)
 {
-    return Query(shared_from_this());
+
 }
 
-Transaction SqliteDatabase::begin_transaction()
+bool FunctionContext::is_null(int idx) const noexcept
 {
-    return Transaction(shared_from_this());
+    return sqlite3_value_type(argv[idx]) == SQLITE_NULL;
+}
+
+int64_t FunctionContext::get_int64(int idx) const noexcept
+{
+    return sqlite3_value_int64(argv[idx]);
+}
+
+double FunctionContext::get_double(int idx) const noexcept
+{
+    return sqlite3_value_double(argv[idx]);
+}
+
+std::string_view FunctionContext::get_string_view(int idx) const noexcept
+{
+    auto text = reinterpret_cast<const char *>(sqlite3_value_text(argv[idx]));
+    if (!text) {
+        return {};
+    }
+    return std::string_view(text, static_cast<size_t>(sqlite3_value_bytes(argv[idx])));
+}
+
+BlobView FunctionContext::get_blob(int idx) const noexcept
+{
+    auto data = static_cast<const uint8_t *>(sqlite3_value_blob(argv[idx]));
+    return BlobView(data, data ? static_cast<size_t>(sqlite3_value_bytes(argv[idx])) : 0);
+}
+
+void FunctionContext::result_null() noexcept
+{
+    sqlite3_result_null(context);
+}
+
+void FunctionContext::result_int64(int64_t value) noexcept
+{
+    sqlite3_result_int64(context, value);
+}
+
+void FunctionContext::result_double(double value) noexcept
+{
+    sqlite3_result_double(context, value);
+}
+
+void FunctionContext::result_text(std::string_view value) noexcept
+{
+    sqlite3_result_text64(context, value.data(), value.size(), SQLITE_TRANSIENT, SQLITE_UTF8);
+}
+
+void FunctionContext::result_blob(BlobView value) noexcept
+{
+    if (!value.data()) {
+        // A null pointer would be a NULL result
+        sqlite3_result_zeroblob(context, 0);
+        return;
+    }
+    sqlite3_result_blob64(context, value.data(), value.size(), SQLITE_TRANSIENT);
+}
+
+void FunctionContext::result_error(const char *message) noexcept
+{
+    sqlite3_result_error(context, message, -1);
+}
+
+void *FunctionContext::get_aggregate_state(size_t size) noexcept
+{
+    return sqlite3_aggregate_context(context, static_cast<int>(size));
+}
+
+void *FunctionContext::peek_aggregate_state() noexcept
+{
+    return sqlite3_aggregate_context(context, 0);
+}
+
+
+
+void UserFunction::call(FunctionContext &context)
+{
+    context.result_error("Function isn't callable");
+}
+
+void UserFunction::step(FunctionContext &context)
+{
+    context.result_error("Function isn't an aggregate");
+}
+
+void UserFunction::final(FunctionContext &context)
+{
+    context.result_error("Function isn't an aggregate");
 }
 
 
 
 DatabaseException::DatabaseException(sqlite3 *db) :
-    message(db ? sqlite3_errmsg(db) : "Database isn't open")
+    message(db ? sqlite3_errmsg(db) : "Database isn't open"), code(db ? sqlite3_extended_errcode(db) : SQLITE_MISUSE)
 {
 
 }
 
 DatabaseException::DatabaseException(const char *msg) :
-    message(msg)
+    message(msg), code(SQLITE_ERROR)
+{
+
+}
+
+DatabaseException::DatabaseException(const DatabaseStatus &status) :
+    message(status.get_message()), code(status.get_code())
 {
 
 }
@@ -424,3 +2560,49 @@ const char *DatabaseException::what() const noexcept
 {
     return message.c_str();
 }
+
+int DatabaseException::get_code() const noexcept
+{
+    return code;
+}
+
+
+
+DatabaseStatus::DatabaseStatus(int code, sqlite3 *db) noexcept :
+    code(code), db(db)
+{
+
+}
+
+bool DatabaseStatus::has_row() const noexcept
+{
+    return code == SQLITE_ROW;
+}
+
+bool DatabaseStatus::is_done() const noexcept
+{
+    return code == SQLITE_DONE || code == SQLITE_OK;
+}
+
+bool DatabaseStatus::is_error() const noexcept
+{
+    return code != SQLITE_OK && code != SQLITE_ROW && code != SQLITE_DONE;
+}
+
+bool DatabaseStatus::is_constraint() const noexcept
+{
+    return get_primary_code() == SQLITE_CONSTRAINT;
+}
+
+bool DatabaseStatus::is_busy() const noexcept
+{
+    return get_primary_code() == SQLITE_BUSY || get_primary_code() == SQLITE_LOCKED;
+}
+
+const char *DatabaseStatus::get_message() const noexcept
+{
+    if (db && sqlite3_extended_errcode(db) == code) {
+        return sqlite3_errmsg(db);
+    }
+    return sqlite3_errstr(code);
+}
@@ -0,0 +1,141 @@
+/*
+Sqlite Database wrapper for Modern C++
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+SPDX-License-Identifier: MIT
+
+Copyright (c) 2020 Ivan Volnov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <sqlite_database/write_batcher.h>
+#include <libs/sqlite3/sqlite3.h>
+#include <algorithm>
+
+
+
+WriteBatcher::WriteBatcher(std::shared_ptr<SqliteDatabase> database, std::chrono::milliseconds max_delay, size_t max_batch) MAYTHROW :
+    database(std::move(database)), max_delay(max_delay), max_batch(std::max<size_t>(max_batch, 1))
+{
+    if (!sqlite3_threadsafe()) {
+        throw DatabaseException("WriteBatcher requires sqlite built with SQLITE_DATABASE_THREADSAFE=ON");
+    }
+    worker = std::thread(&WriteBatcher::run, this);
+}
+
+WriteBatcher::~WriteBatcher()
+{
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    wakeup.notify_one();
+    worker.join();
+}
+
+std::unique_ptr<WriteBatcher> WriteBatcher::open(const std::string &filename, const OpenOptions &options,
+                                                 std::chrono::milliseconds max_delay, size_t max_batch) MAYTHROW
+{
+    return std::make_unique<WriteBatcher>(SqliteDatabase::open(filename, options), max_delay, max_batch);
+}
+
+void WriteBatcher::flush() noexcept
+{
+    {
+        std::lock_guard lock(mutex);
+        // cleared when the queue drains, an empty queue has nothing to clear it
+        if (!head) {
+            return;
+        }
+        flushing = true;
+    }
+    wakeup.notify_one();
+}
+
+uint64_t WriteBatcher::get_commit_count() const noexcept
+{
+    return commit_count.load(std::memory_order_relaxed);
+}
+
+uint64_t WriteBatcher::get_write_count() const noexcept
+{
+    return write_count.load(std::memory_order_relaxed);
+}
+
+void WriteBatcher::push(DatabaseTask *task) noexcept
+{
+    bool notify;
+    {
+        std::lock_guard lock(mutex);
+        if (tail) {
+            tail->next = task;
+        }
+        else {
+            head = task;
+            deadline = std::chrono::steady_clock::now() + max_delay;
+        }
+        tail = task;
+        // The worker waits for the first write and then for a full batch
+        notify = ++pending == 1 || pending == max_batch;
+    }
+    if (notify) {
+        wakeup.notify_one();
+    }
+}
+
+void WriteBatcher::run() noexcept
+{
+    std::unique_lock lock(mutex);
+    while (true) {
+        wakeup.wait(lock, [this] { return stopping || head; });
+        if (!head) {
+            return;
+        }
+        wakeup.wait_until(lock, deadline, [this] { return stopping || flushing || pending >= max_batch; });
+        // Writes queued during the previous commit may exceed max_batch, the rest goes to the next transaction
+        auto tasks = head;
+        auto last = head;
+        size_t count = 1;
+        for (; count < max_batch && last->next; ++count) {
+            last = last->next;
+        }
+        head = last->next;
+        last->next = nullptr;
+        pending -= count;
+        if (head) {
+            deadline = std::chrono::steady_clock::now();
+        }
+        else {
+            tail = nullptr;
+            flushing = false;
+        }
+        lock.unlock();
+        execute(tasks);
+        lock.lock();
+    }
+}
+
+void WriteBatcher::execute(DatabaseTask *tasks) noexcept
+{
+    DatabaseTask::run_write_batch(*database, tasks, nullptr, [this](size_t count) {
+        commit_count.fetch_add(1, std::memory_order_relaxed);
+        write_count.fetch_add(count, std::memory_order_relaxed);
+    });
+}